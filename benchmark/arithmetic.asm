@@ -0,0 +1,26 @@
+MEM 64
+
+#
+# Mixed arithmetic and bitwise kernel over a linear congruential sequence
+#
+
+SET 1 1  # 1: x
+SET 0 2  # 2: i
+SET 0 4  # 4: checksum
+
+NOP 30  # 30: loop
+MUL *1 75 1
+ADD *1 74 1
+MOD *1 65537 1
+DIV *1 3 3  # 3: temporary
+SUB *1 *3 3
+XOR *4 *3 4
+SHL *4 1 5
+SHR *4 30 6
+OR *5 *6 4
+AND *4 1073741823 4
+INC *2 2
+LESS *2 2000000 7
+JIF *7 *30
+
+OUT *4
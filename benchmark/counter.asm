@@ -0,0 +1,14 @@
+MEM 16
+
+#
+# Tight counter loop
+#
+
+SET 0 1  # 1: i
+
+NOP 10  # 10: loop
+INC *1 1
+LESS *1 10000000 2  # 2: i < 10000000
+JIF *2 *10
+
+OUT *1
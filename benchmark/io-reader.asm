@@ -0,0 +1,17 @@
+MEM 16
+
+#
+# Read n numbers and print every running sum
+#
+
+IN 1  # 1: n
+SET 0 2  # 2: i
+SET 0 3  # 3: sum
+
+NOP 10  # 10: loop
+IN 4
+ADD *3 *4 3
+OUT *3
+INC *2 2
+LESS *2 *1 5
+JIF *5 *10
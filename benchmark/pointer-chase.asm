@@ -0,0 +1,28 @@
+MEM 8192
+
+#
+# Chase a cyclic list of 4096 cells with deep dereferences
+#
+
+SET 0 2  # 2: i
+
+NOP 20  # 20: build
+ADD *2 1031 3  # 3: next cell
+MOD *3 4096 3
+ADD *3 100 3
+ADD *2 100 4  # 4: cell
+SET *3 *4
+INC *2 2
+LESS *2 4096 5
+JIF *5 *20
+
+SET 100 1  # 1: pointer
+SET 0 6  # 6: k
+
+NOP 21  # 21: chase
+SET *****1 1  # four steps
+INC *6 6
+LESS *6 2000000 5
+JIF *5 *21
+
+OUT *1
@@ -0,0 +1,48 @@
+MEM 4096
+
+#
+# Insertion sort of 2000 pseudo-random numbers at 1000
+#
+
+SET 1 1  # 1: x
+SET 0 2  # 2: i
+
+NOP 30  # 30: generate
+MUL *1 75 1
+ADD *1 74 1
+MOD *1 65537 1
+ADD *2 1000 3  # 3: &a[i]
+SET *1 *3
+INC *2 2
+LESS *2 2000 4
+JIF *4 *30
+
+SET 1 2
+
+NOP 31  # 31: outer loop
+ADD *2 1000 3
+SET **3 5  # 5: key
+DEC *2 6  # 6: j
+ADD *6 1000 7  # 7: &a[j]
+
+NOP 32  # 32: inner loop
+LESS *6 0 8
+JIF *8 *33
+LEQ **7 *5 8
+JIF *8 *33
+ADD *7 1 9  # 9: &a[j + 1]
+SET **7 *9
+DEC *6 6
+DEC *7 7
+JMP *32
+
+NOP 33  # 33: insert
+ADD *7 1 9
+SET *5 *9
+INC *2 2
+LESS *2 2000 4
+JIF *4 *31
+
+OUT *1000
+OUT *2000
+OUT *2999
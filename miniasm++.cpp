@@ -7,16 +7,46 @@
 #include <cassert>
 #include <cctype>
 #include <climits>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iterator>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <random>
+#include <string>
+#include <thread>
 #include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 using namespace std;
 
 ///////////////////////////////
@@ -24,20 +54,104 @@ using namespace std;
 ///////////////////////////////
 
 /**
- * Assertion
+ * Error raised by `CHECK` and `ASSERT`
+ */
+class Error {
+ public:
+    enum Kind {
+        None,
+        System,             // Files, sockets and other failures of the host
+        Syntax,             // Malformed program text
+        MemoryIndex,        // Memory access out of range
+        MemoryLimit,        // `MEM` too large
+        ReferenceOverflow,  // Too many `*`
+        InvalidPosition,    // Jump before the first command
+        InvalidArgument,    // Such as a negative vector length
+        Arithmetic,         // Division by zero or overflow
+        TimeLimit,          // Time limit exceeded
+        ThreadLimit,        // Too many `SPAWN` threads
+        Unsupported         // Feature not available in this mode
+    };  // enum Kind
+
+    Error() : kind(None), message(nullptr), position(-1), instructions(0) {}
+
+    Error(const Kind kind, const char *message)
+            : kind(kind), message(message), position(-1), instructions(0) {}
+
+    /**
+     * Print the error like `(ERROR) message (command 3, 12 instructions)`
+     * @param out Target file
+     */
+    void print(FILE *out) const {
+        if (kind == Syntax && position >= 0)
+            fprintf(out, "(ERROR) %s (line %d)\n", message, position + 1);
+        else if (position >= 0)
+            fprintf(out,
+                    "(ERROR) %s (command %d, %zu instructions)\n",
+                    message,
+                    position,
+                    instructions);
+        else
+            fprintf(out, "(ERROR) %s\n", message);
+    }
+
+    Kind kind;
+    const char *message;
+
+    /**
+     * Command being executed, or line for syntax errors, -1 if unknown
+     */
+    int position;
+
+    /**
+     * Number of instructions executed before the error
+     */
+    size_t instructions;
+};  // class Error
+
+/**
+ * Check a condition of the program being executed or loaded
  * @param  expr    Bool expression
- * @param  message The message that will be printed to screen via `printf` when
- * the expression is false
+ * @param  kind    Member of `Error::Kind` raised when the expression is false
+ * @param  message Static description of the error
  * @return         No return
  */
-#define ASSERT(expr, message)            \
-    if (!(expr)) {                       \
-        printf("(ERROR) %s\n", message); \
-        exit(-1);                        \
+#define CHECK(expr, kind, message)         \
+    if (!(expr)) {                         \
+        throw Error(Error::kind, message); \
     }
 
+/**
+ * Assertion on the host, e.g. that a file can be opened
+ * @param  expr    Bool expression
+ * @param  message Static description of the error
+ * @return         No return
+ */
+#define ASSERT(expr, message) CHECK(expr, System, message)
+
+/**
+ * 1 for printing every executed instruction to stdout
+ * 0 otherwise
+ */
+#ifndef TRACE_MODE
+#define TRACE_MODE 0
+#endif  // IFNDEF TRACE_MODE
+
+/**
+ * Commit the interpreter is built from, recorded by `--bench --history`
+ * Empty if unknown, then `--commit` is required.
+ */
+#ifndef MINIASM_COMMIT
+#define MINIASM_COMMIT ""
+#endif  // IFNDEF MINIASM_COMMIT
+
+#if TRACE_MODE
 #define DEBUG(message) puts(message);
 #define DEBUGF(message, ...) printf(message "\n", __VA_ARGS__);
+#else
+#define DEBUG(message)
+#define DEBUGF(message, ...)
+#endif  // IF TRACE_MODE
 
 /**
  * 1 for enabling friendly mode to users
@@ -45,14 +159,22 @@ using namespace std;
  */
 #define FRIENDLY_MODE 0
 
+/**
+ * Generator of `randint` in the calling thread
+ * @return mt19937 &
+ */
+inline mt19937 &random_generator() {
+    static thread_local mt19937 generator(random_device{}());
+
+    return generator;
+}
+
 /**
  * Generate a  random integer
  * @return Random integer
  */
 inline int randint() {
-    static random_device rd;
-
-    return rd();
+    return random_generator()();
 }
 
 /////////////////
@@ -61,20 +183,40 @@ inline int randint() {
 
 class MemoryPool {
  public:
+    /**
+     * Callback of watchpoints, called from a signal handler
+     * @param pos       Index of the changed cell
+     * @param old_value Value before the write
+     * @param new_value Value after the write
+     */
+    typedef void (*WatchCallback)(size_t pos, int old_value, int new_value);
+
     /**
      * The maximum size of int array
      */
     constexpr static size_t MaxMemorySize = 10000000;
 
-    MemoryPool() : _size(0), _mem(nullptr) {}
-
-    MemoryPool(const size_t size) : _mem(nullptr) {
+    /**
+     * The maximum number of pools with a snapshot at the same time
+     */
+    constexpr static size_t MaxTrackedPools = 4096;
+
+    MemoryPool()
+            : _size(0),
+              _pages(0),
+              _mem(nullptr),
+              _snapshot(nullptr),
+              _dirty(nullptr),
+              _dirty_list(nullptr),
+              _dirty_count(0),
+              _registered(false) {}
+
+    MemoryPool(const size_t size) : MemoryPool() {
         resize(size);
     }
 
     ~MemoryPool() {
-        if (_mem)
-            delete _mem;
+        release();
     }
 
     /**
@@ -83,25 +225,39 @@ class MemoryPool {
      * @return     int &
      */
     int &operator[](const size_t pos) {
-        ASSERT(0 <= pos && pos < _size, "Memory index error");
+        CHECK(0 <= pos && pos < _size, MemoryIndex, "Memory index error");
 
         return _mem[pos];
     }
 
+    /**
+     * Access a contiguous range of the int array
+     * @param  pos Index of the first element
+     * @param  len Number of elements
+     * @return     Pointer to the first element
+     */
+    int *range(const size_t pos, const size_t len) {
+        CHECK(pos <= _size && len <= _size - pos,
+              MemoryIndex,
+              "Memory index error");
+
+        return _mem + pos;
+    }
+
     /**
      * Resize  the int array
      * @param  size New size
      * @remark If succeeded, the original int array will be deleted and new
-     * array is initialized again
+     * array is initialized again. The snapshot is dropped.
      */
     void resize(const size_t size) {
-        ASSERT(size <= MaxMemorySize, "Memory limit exceeded");
+        CHECK(size <= MaxMemorySize, MemoryLimit, "Memory limit exceeded");
 
-        if (_mem)
-            delete _mem;
+        release();
 
         _size = size;
-        _mem = new int[size];
+        _pages = (size * sizeof(int) + page_size() - 1) / page_size();
+        _mem = allocate(_pages);
 
 #if FRIENDLY_MODE
         memset(_mem, 0, sizeof(int) * size);
@@ -111,1222 +267,7764 @@ class MemoryPool {
 #endif  // IF FRIENDLY_MODE
     }
 
- private:
-    size_t _size;
-    int *_mem;
-};  // class MemoryPool
+    /**
+     * Save current contents, later restored by `reset`
+     * Pages are write-protected after the snapshot and the first write to a
+     * page marks it dirty, so both `reset` and taking the snapshot again only
+     * copy pages written since the last snapshot or reset.
+     */
+    void snapshot() {
+        if (!_snapshot) {
+            ASSERT(_dirty == nullptr, "(internal) Memory is already tracked");
+
+            _snapshot = allocate(_pages);
+            memcpy(_snapshot, _mem, _pages * page_size());
+            start_tracking();
+            return;
+        }
 
-///////////
-// VALUE //
-///////////
+        for (size_t i = 0; i < _dirty_count; i++)
+            copy_page(_snapshot, _mem, _dirty_list[i]);
+        clear_dirty();
+    }
 
-class Value {
- public:
-    constexpr static size_t MaxReferenceRecursive = 256;
+    /**
+     * Restore the contents saved by `snapshot`
+     */
+    void reset() {
+        ASSERT(_snapshot != nullptr, "(internal) No snapshot to reset");
 
-    Value() : _recur(0) {
-#if FRIENDLY_MODE
-        _value = 0;
-#else
-        _value = randint();
-#endif  // IF FRIENDLY_MODE
+        for (size_t i = 0; i < _dirty_count; i++)
+            copy_page(_mem, _snapshot, _dirty_list[i]);
+        clear_dirty();
     }
 
     /**
-     * Set value
-     * @param value Literal value
-     * @param recur Number of dereference recursive
+     * Return whether `snapshot` has been taken since the last `resize`
+     * @return Bool
      */
-    void set(const int value, const size_t recur) {
-        _value = value;
-        _recur = recur;
+    bool has_snapshot() const {
+        return _snapshot != nullptr;
     }
 
     /**
-     * Return the real value in specified memory pool
-     * @param  memory Memory pool
-     * @return        Real value
+     * Return the number of pages written since the last snapshot or reset
+     * @return size_t
      */
-    int get(MemoryPool *memory) const {
-        ASSERT(memory != nullptr, "(internal) NULL memory pool received");
-        ASSERT(_recur <= MaxReferenceRecursive, "References overflow");
-
-        int result = _value;
-
-        for (size_t i = 0; i < _recur; i++)
-            result = (*memory)[result];
+    size_t dirty_count() const {
+        return _dirty_count;
+    }
 
-        return result;
+    /**
+     * Return the number of elements
+     * @return size_t
+     */
+    size_t size() const {
+        return _size;
     }
 
- private:
-    int _value;
-    size_t _recur;
-};  // class Value
+    /**
+     * Return the number of pages holding the elements
+     * @return size_t
+     */
+    size_t pages() const {
+        return _pages;
+    }
 
-/////////////////
-// INSTRUCTION //
-/////////////////
+    static size_t page_size() {
+        static const size_t size = sysconf(_SC_PAGESIZE);
 
-class Program;
+        return size;
+    }
 
-class Instruction {
- public:
-    static Program *env;
+    /**
+     * Return the contents of a page
+     * @param  page Index of the page
+     * @return      Pointer to `page_size()` bytes
+     */
+    const char *page(const size_t page) const {
+        return reinterpret_cast<const char *>(_mem) + page * page_size();
+    }
 
-    virtual ~Instruction();
+    /**
+     * Return pages written since the last snapshot or reset
+     * @return Indexes of the pages
+     */
+    vector<size_t> dirty_pages() const {
+        return vector<size_t>(_dirty_list, _dirty_list + _dirty_count);
+    }
 
     /**
-     * `execute` interface
-     * @param  _args Command arguments
-     * @return       Used time
+     * Return the contents of a page in the snapshot
+     * @param  page Index of the page
+     * @return      Pointer to `page_size()` bytes
      */
-    virtual size_t execute(const void *_args) = 0;
+    const char *saved_page(const size_t page) const {
+        return reinterpret_cast<const char *>(_snapshot) + page * page_size();
+    }
 
-    virtual void delete_args(const void *_args) = 0;
-};  // class Instruction
+    /**
+     * Overwrite a page in both the memory and the snapshot
+     * The page stays clean, so snapshots taken later do not copy it.
+     * @param page Index of the page
+     * @param data `page_size()` bytes
+     */
+    void revert_page(const size_t page, const char *data) {
+        ASSERT(_snapshot != nullptr, "(internal) No snapshot to revert");
+
+        char *target = reinterpret_cast<char *>(_mem) + page * page_size();
+        memcpy(reinterpret_cast<char *>(_snapshot) + page * page_size(),
+               data,
+               page_size());
+        mprotect(target, page_size(), PROT_READ | PROT_WRITE);
+        memcpy(target, data, page_size());
+        if (!_dirty[page] || watched(page))
+            protect(page, 1);
+        if (watched(page))
+            check_watches(page);
+    }
 
-Program *Instruction::env;
+    /**
+     * Return pages written since the previous call, without a snapshot
+     * The first call starts tracking writes and returns every page.
+     * @return Indexes of the pages
+     */
+    vector<size_t> take_dirty() {
+        ASSERT(_snapshot == nullptr, "(internal) Memory has a snapshot");
+
+        vector<size_t> pages;
+        if (!_dirty) {
+            for (size_t i = 0; i < _pages; i++)
+                pages.push_back(i);
+            start_tracking();
+            return pages;
+        }
 
-Instruction::~Instruction() = default;
+        pages.assign(_dirty_list, _dirty_list + _dirty_count);
+        clear_dirty();
+        return pages;
+    }
 
-/////////////
-// PROGRAM //
-/////////////
+    /**
+     * Report writes changing cells of a range
+     * Pages holding the range are write-protected. A write to them faults and
+     * is executed again alone, with the trap flag set; the trap handler then
+     * compares the watched cells with their previous values and protects the
+     * page again. Reads and other pages run at full speed.
+     * @param pos      Index of the first cell
+     * @param len      Number of cells
+     * @param callback Called for every changed cell
+     * @remark Only supported on x86-64 Linux. With several threads writing the
+     * same page at once, a change can be reported to the wrong writer.
+     */
+    void watch(const size_t pos, const size_t len, WatchCallback callback) {
+#if defined(__x86_64__) && defined(__linux__)
+        CHECK(len > 0 && pos <= _size && len <= _size - pos,
+              MemoryIndex,
+              "Memory index error");
+
+        install_handler();
+        install_trap_handler();
+        if (!_registered)
+            register_pool();
+        if (_watched.empty())
+            _watched.assign(_pages, false);
+
+        _watches.push_back({ pos, len, _shadow.size(), callback });
+        _shadow.insert(_shadow.end(), _mem + pos, _mem + pos + len);
+
+        size_t first = pos * sizeof(int) / page_size();
+        size_t last = ((pos + len) * sizeof(int) - 1) / page_size();
+        for (size_t i = first; i <= last; i++)
+            _watched[i] = true;
+        protect(first, last - first + 1);
+#else
+        CHECK(false, Unsupported, "Watchpoints need x86-64 Linux");
+#endif  // IF __x86_64__ && __linux__
+    }
 
-class Program {
- public:
     /**
-     * Max time count
+     * Replace a page with a private copy-on-write mapping of a file
+     * @param page   Index of the page
+     * @param fd     File descriptor
+     * @param offset Offset of the page in the file, a multiple of the page size
      */
-    constexpr static size_t Timelimit = 50000000;
+    void map_page(const size_t page, const int fd, const off_t offset) {
+        ASSERT(_dirty == nullptr, "(internal) Memory is already tracked");
+
+        void *p = mmap(reinterpret_cast<char *>(_mem) + page * page_size(),
+                       page_size(),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED,
+                       fd,
+                       offset);
+        ASSERT(p != MAP_FAILED, "Cannot map checkpoint");
+    }
 
-    struct Command {
-        Instruction *instruction;
-        void *args;
+ private:
+    static int *allocate(const size_t pages) {
+        if (pages == 0)
+            return nullptr;
+
+        void *p = mmap(nullptr,
+                       pages * page_size(),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+        CHECK(p != MAP_FAILED, MemoryLimit, "Memory limit exceeded");
+
+        return reinterpret_cast<int *>(p);
+    }
 
-        bool is_valid() const {
-            return instruction != nullptr && args != nullptr;
+    void release() {
+        if (_registered)
+            unregister_pool();
+        if (_dirty) {
+            delete[] _dirty;
+            delete[] _dirty_list;
         }
-    };  // struct Command
 
-    Program() : current(0), _timer(0) {}
+        if (_snapshot)
+            munmap(_snapshot, _pages * page_size());
 
-    ~Program() {
-        for (auto &e : _commands) {
-            ASSERT(e.args != nullptr, "Argument missing");
+        if (_mem)
+            munmap(_mem, _pages * page_size());
+
+        _mem = _snapshot = nullptr;
+        _dirty = nullptr;
+        _dirty_list = nullptr;
+        _dirty_count = 0;
+        _watched.clear();
+        _watches.clear();
+        _shadow.clear();
+    }
 
-            e.instruction->delete_args(e.args);
-            delete e.instruction;
-        }  // foreach in _commands
+    void copy_page(int *target, const int *source, const size_t page) {
+        size_t offset = page * page_size() / sizeof(int);
+        memcpy(target + offset, source + offset, page_size());
+    }
+
+    void protect(const size_t page, const size_t count) {
+        mprotect(reinterpret_cast<char *>(_mem) + page * page_size(),
+                 count * page_size(),
+                 PROT_READ);
     }
 
     /**
-     * Indicate that whether the program has exited
-     * @return Bool
+     * Write-protect all pages and mark them dirty on their first write
      */
-    bool exited() const {
-        return current >= static_cast<int>(_commands.size());
+    void start_tracking() {
+        install_handler();
+
+        _dirty = new atomic<bool>[_pages];
+        _dirty_list = new size_t[_pages];
+        for (size_t i = 0; i < _pages; i++)
+            _dirty[i] = false;
+
+        if (!_registered)
+            register_pool();
+        protect(0, _pages);
+    }
+
+    bool watched(const size_t page) const {
+        return !_watched.empty() && _watched[page];
     }
 
     /**
-     * Return the timer
-     * @return size_t
+     * Report changed watched cells of a page and remember their values
      */
-    size_t passed_time() const {
-        return _timer;
+    void check_watches(const size_t page) {
+        size_t begin = page * page_size() / sizeof(int);
+        size_t end = (page + 1) * page_size() / sizeof(int);
+
+        for (auto &w : _watches) {
+            size_t first = max(begin, w.pos);
+            size_t last = min(end, w.pos + w.len);
+            for (size_t i = first; i < last; i++) {
+                int &old = _shadow[w.shadow + i - w.pos];
+                if (old != _mem[i]) {
+                    w.callback(i, old, _mem[i]);
+                    old = _mem[i];
+                }
+            }  // for
+        }  // foreach in _watches
+    }
+
+    void clear_dirty() {
+        for (size_t i = 0; i < _dirty_count; i++) {
+            _dirty[_dirty_list[i]] = false;
+            protect(_dirty_list[i], 1);
+        }  // for
+
+        _dirty_count = 0;
     }
 
     /**
-     * Append new command to the end of program
-     * @param command New command
+     * Mark the page containing `address` dirty and make it writable, or step
+     * over the write if the page is watched
+     * @return false if `address` is not in this pool
+     * @remark Called in the signal handler
      */
-    void append(const Command &command) {
-        ASSERT(command.is_valid(), "(internal) NULL command received");
+    bool track(void *address, void *context) {
+        char *p = reinterpret_cast<char *>(address);
+        char *begin = reinterpret_cast<char *>(_mem);
+        if (p < begin || p >= begin + _pages * page_size())
+            return false;
+
+        size_t page = (p - begin) / page_size();
+        if (watched(page)) {
+            if (_dirty && !_dirty[page].exchange(true))
+                _dirty_list[_dirty_count.fetch_add(1)] = page;
+            step(page, context);
+            return true;
+        }
 
-        _commands.push_back(command);
-    }
+        if (!_dirty)
+            return false;
+        if (!_dirty[page].exchange(true)) {
+            _dirty_list[_dirty_count.fetch_add(1)] = page;
+            mprotect(begin + page * page_size(),
+                     page_size(),
+                     PROT_READ | PROT_WRITE);
+        }
 
-    void make_environment() {
-        Instruction::env = this;
+        return true;
     }
 
     /**
-     * Run program until exited or exceeded the time limit
+     * Make a watched page writable for the faulting instruction only
      */
-    void run();
+    void step(const size_t page, void *context) {
+#if defined(__x86_64__) && defined(__linux__)
+        mprotect(reinterpret_cast<char *>(_mem) + page * page_size(),
+                 page_size(),
+                 PROT_READ | PROT_WRITE);
+        _stepping = this;
+        _stepping_page = page;
+        static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_EFL] |=
+                TrapFlag;
+#endif  // IF __x86_64__ && __linux__
+    }
 
-    void run_partical();
+    void register_pool() {
+        for (auto &slot : _tracked) {
+            MemoryPool *expected = nullptr;
+            if (slot.pool.compare_exchange_strong(expected, this)) {
+                _registered = true;
+                return;
+            }
+        }  // foreach in _tracked
 
-    MemoryPool memory;
-    int current;
+        ASSERT(false, "Too many memory snapshots");
+    }
 
- private:
-    size_t _timer;
-    vector<Command> _commands;
-};  // class Program
+    /**
+     * Remove the pool from `_tracked` and wait until no fault handler uses it
+     */
+    void unregister_pool() {
+        _registered = false;
+        for (auto &slot : _tracked) {
+            MemoryPool *expected = this;
+            if (!slot.pool.compare_exchange_strong(expected, nullptr))
+                continue;
+
+            while (slot.users.load() > 0)
+                this_thread::yield();
+            return;
+        }  // foreach in _tracked
+    }
 
-/////////////////////////////////
-// INSTRUCTION IMPLEMENTATIONS //
-/////////////////////////////////
+    static void install_handler() {
+        static once_flag flag;
+
+        call_once(flag, []() {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = &MemoryPool::on_fault;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, &_previous_handler);
+        });
+    }
 
-#define GET(name) args->name.get(&env->memory)
-#define IMPLEMENT_BASIS(args_type)                              \
-    virtual void delete_args(const void *_args) {               \
-        auto args = reinterpret_cast<const args_type *>(_args); \
-        delete args;                                            \
-    }                                                           \
-    typedef args_type ArgsType;
+    static void on_fault(int signal, siginfo_t *info, void *context) {
+        for (auto &slot : _tracked) {
+            if (!slot.pool.load())
+                continue;
 
-class NopInstruction final : public Instruction {
- public:
-    struct NopArgs {};  // struct NopArgs
+            // Pinned until `users` drops, so the pool cannot be released
+            slot.users++;
+            MemoryPool *pool = slot.pool.load();
+            bool tracked = pool && pool->track(info->si_addr, context);
+            slot.users--;
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const NopArgs *>(_args);
-        DEBUG("NOP")
+            if (tracked)
+                return;
+        }  // foreach in _tracked
 
-        return 0;
+        forward(signal, info, context, _previous_handler);
     }
 
-    IMPLEMENT_BASIS(NopArgs)
-};  // class NopInstruction
+    /**
+     * Pass a signal that is not ours to the handler installed before
+     * The default action is taken by restoring it and raising the signal
+     * again, which ends the process.
+     */
+    static void forward(int signal,
+                        siginfo_t *info,
+                        void *context,
+                        const struct sigaction &previous) {
+        if (previous.sa_flags & SA_SIGINFO) {
+            previous.sa_sigaction(signal, info, context);
+            return;
+        }
+        if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(signal);
+            return;
+        }
 
-class TaggedNopInstruction final : public Instruction {
- public:
-    struct TaggedNopArgs {
-        Value index;
-    };  // struct TaggedNopArgs
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = SIG_DFL;
+        sigemptyset(&action.sa_mask);
+        sigaction(signal, &action, nullptr);
+        raise(signal);
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const TaggedNopArgs *>(_args);
-        DEBUGF("NOP %d", GET(index))
+#if defined(__x86_64__) && defined(__linux__)
+    /**
+     * Trap flag of RFLAGS, raising SIGTRAP after the next instruction
+     */
+    constexpr static greg_t TrapFlag = 0x100;
+
+    static void install_trap_handler() {
+        static once_flag flag;
+
+        call_once(flag, []() {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = &MemoryPool::on_trap;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGTRAP, &action, &_previous_trap_handler);
+        });
+    }
 
-        env->memory[GET(index)] = env->current;
+    static void on_trap(int signal, siginfo_t *info, void *context) {
+        MemoryPool *pool = _stepping;
+        if (!pool) {
+            forward(signal, info, context, _previous_trap_handler);
+            return;
+        }
 
-        return 0;
+        static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_EFL] &=
+                ~TrapFlag;
+        _stepping = nullptr;
+        pool->check_watches(_stepping_page);
+        pool->protect(_stepping_page, 1);
     }
 
-    IMPLEMENT_BASIS(TaggedNopArgs)
-};  // class TaggedNopInstruction
+    static struct sigaction _previous_trap_handler;
+#endif  // IF __x86_64__ && __linux__
 
-class MemInstruction final : public Instruction {
- public:
-    struct MemArgs {
-        Value value;
-    };  // struct MemArgs
+    /**
+     * Registered pool and the number of fault handlers using it
+     */
+    struct Slot {
+        atomic<MemoryPool *> pool;
+        atomic<size_t> users;
+    };  // struct Slot
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const MemArgs *>(_args);
-        DEBUGF("MEM %d", GET(value))
+    static Slot _tracked[MaxTrackedPools];
+    static struct sigaction _previous_handler;
 
-        env->memory.resize(GET(value));
+    /**
+     * Pool and page of the write being stepped over on this thread
+     */
+    static thread_local MemoryPool *_stepping;
+    static thread_local size_t _stepping_page;
 
-        return 0;
-    }
+    /**
+     * Watched range, with the previous values of its cells in `_shadow`
+     * starting at `shadow`
+     */
+    struct Watch {
+        size_t pos;
+        size_t len;
+        size_t shadow;
+        WatchCallback callback;
+    };  // struct Watch
 
-    IMPLEMENT_BASIS(MemArgs)
-};  // class MemInstruction
+    size_t _size;
+    size_t _pages;
+    int *_mem;
+    int *_snapshot;
+    atomic<bool> *_dirty;
+    size_t *_dirty_list;
+    atomic<size_t> _dirty_count;
+    bool _registered;
+    vector<bool> _watched;
+    vector<Watch> _watches;
+    vector<int> _shadow;
+};  // class MemoryPool
 
-class InInstruction final : public Instruction {
- public:
-    struct InArgs {
-        Value index;
-    };  // struct InArgs
+MemoryPool::Slot MemoryPool::_tracked[MemoryPool::MaxTrackedPools];
+struct sigaction MemoryPool::_previous_handler;
+thread_local MemoryPool *MemoryPool::_stepping;
+thread_local size_t MemoryPool::_stepping_page;
+#if defined(__x86_64__) && defined(__linux__)
+struct sigaction MemoryPool::_previous_trap_handler;
+#endif  // IF __x86_64__ && __linux__
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const InArgs *>(_args);
-        DEBUGF("IN %d", GET(index))
+///////////
+// VALUE //
+///////////
 
-        int result;
-        scanf("%d", &result);
-        env->memory[GET(index)] = result;
+class Value {
+ public:
+    constexpr static size_t MaxReferenceRecursive = 256;
 
-        return 0;
+    Value() : _recur(0) {
+#if FRIENDLY_MODE
+        _value = 0;
+#else
+        _value = randint();
+#endif  // IF FRIENDLY_MODE
     }
 
-    IMPLEMENT_BASIS(InArgs)
-};  // class InInstruction
-
-class OutInstruction final : public Instruction {
- public:
-    struct OutArgs {
-        Value value;
-    };  // struct OutArgs
+    /**
+     * Set value
+     * @param value Literal value
+     * @param recur Number of dereference recursive
+     */
+    void set(const int value, const size_t recur) {
+        _value = value;
+        _recur = recur;
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const OutArgs *>(_args);
-        DEBUGF("OUT %d", GET(value))
+    /**
+     * Return the real value in specified memory pool
+     * @param  memory Memory pool
+     * @return        Real value
+     */
+    int get(MemoryPool *memory) const {
+        ASSERT(memory != nullptr, "(internal) NULL memory pool received");
+        CHECK(_recur <= MaxReferenceRecursive,
+              ReferenceOverflow,
+              "References overflow");
 
-        printf("%d\n", GET(value));
-        return 0;
-    }
+        int result = _value;
 
-    IMPLEMENT_BASIS(OutArgs)
-};  // class OutInstruction
+        for (size_t i = 0; i < _recur; i++)
+            result = (*memory)[result];
 
-class SetInstruction final : public Instruction {
- public:
-    struct SetArgs {
-        Value value;
-        Value index;
-    };  // struct SetArgs
+        return result;
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const SetArgs *>(_args);
-        DEBUGF("SET %d %d", GET(value), GET(index))
+ private:
+    int _value;
+    size_t _recur;
+};  // class Value
 
-        env->memory[GET(index)] = GET(value);
+////////////////////
+// VECTOR KERNELS //
+////////////////////
 
-        return 0;
-    }
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECTOR_X86 1
+#include <immintrin.h>
+#else
+#define VECTOR_X86 0
+#endif  // IF __GNUC__ && x86
 
-    IMPLEMENT_BASIS(SetArgs)
-};  // class SetInstruction
+/**
+ * Kernels used by range-wise instructions
+ * All element-wise kernels behave as if elements are processed one by one in
+ * increasing index order, so overlapping ranges (e.g. prefix sums) are well
+ * defined. Arithmetic wraps around on overflow.
+ */
+struct VectorKernels {
+    typedef void (*BinaryKernel)(const int *, const int *, int *, size_t);
+    typedef int (*ReduceKernel)(const int *, size_t);
+
+    BinaryKernel add;
+    BinaryKernel sub;
+    BinaryKernel mul;
+    BinaryKernel cmp;
+    ReduceKernel sum;
+    ReduceKernel max;
+};  // struct VectorKernels
+
+namespace scalar_kernels {
+
+void add(const int *a, const int *b, int *c, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        c[i] = static_cast<unsigned>(a[i]) + static_cast<unsigned>(b[i]);
+}
 
-class AddInstruction final : public Instruction {
- public:
-    struct AddArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct AddArgs
+void sub(const int *a, const int *b, int *c, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        c[i] = static_cast<unsigned>(a[i]) - static_cast<unsigned>(b[i]);
+}
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const AddArgs *>(_args);
-        DEBUGF("ADD %d %d %d", GET(value1), GET(value2), GET(index))
+void mul(const int *a, const int *b, int *c, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        c[i] = static_cast<unsigned>(a[i]) * static_cast<unsigned>(b[i]);
+}
 
-        env->memory[GET(index)] = GET(value1) + GET(value2);
+void cmp(const int *a, const int *b, int *c, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        c[i] = a[i] == b[i];
+}
 
-        return 0;
-    }
+int sum(const int *a, size_t n) {
+    unsigned result = 0;
 
-    IMPLEMENT_BASIS(AddArgs)
-};  // class AddInstruction
+    for (size_t i = 0; i < n; i++)
+        result += static_cast<unsigned>(a[i]);
 
-class SubInstruction final : public Instruction {
- public:
-    struct SubArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct SubArgs
+    return result;
+}
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const SubArgs *>(_args);
-        DEBUGF("SUB %d %d %d", GET(value1), GET(value2), GET(index))
+int max(const int *a, size_t n) {
+    int result = INT_MIN;
 
-        env->memory[GET(index)] = GET(value1) - GET(value2);
+    for (size_t i = 0; i < n; i++)
+        result = a[i] > result ? a[i] : result;
 
-        return 0;
-    }
+    return result;
+}
 
-    IMPLEMENT_BASIS(SubArgs)
-};  // class SubInstruction
+}  // namespace scalar_kernels
 
-class MulInstruction final : public Instruction {
- public:
-    struct MulArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct MulArgs
+#if VECTOR_X86
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const MulArgs *>(_args);
-        DEBUGF("MUL %d %d %d", GET(value1), GET(value2), GET(index))
+/**
+ * Generate SIMD kernels for one instruction set
+ * @param ns     Namespace of the kernels
+ * @param isa    Target passed to `__attribute__((target))`
+ * @param vec    SIMD integer type
+ * @param width  Number of ints in `vec`
+ * @param pre    Intrinsic prefix, `_mm` or `_mm256`
+ * @param suffix Suffix of load/store intrinsics, `si128` or `si256`
+ */
+#define IMPLEMENT_VECTOR_KERNELS(ns, isa, vec, width, pre, suffix)            \
+    namespace ns {                                                            \
+    __attribute__((target(isa))) inline vec load(const int *p) {              \
+        return pre##_loadu_##suffix(reinterpret_cast<const vec *>(p));        \
+    }                                                                         \
+    __attribute__((target(isa))) inline void store(int *p, vec v) {           \
+        pre##_storeu_##suffix(reinterpret_cast<vec *>(p), v);                 \
+    }                                                                         \
+    __attribute__((target(isa))) void add(                                   \
+            const int *a, const int *b, int *c, size_t n) {                   \
+        size_t i = 0;                                                         \
+        for (; i + width <= n; i += width)                                    \
+            store(c + i, pre##_add_epi32(load(a + i), load(b + i)));          \
+        scalar_kernels::add(a + i, b + i, c + i, n - i);                      \
+    }                                                                         \
+    __attribute__((target(isa))) void sub(                                   \
+            const int *a, const int *b, int *c, size_t n) {                   \
+        size_t i = 0;                                                         \
+        for (; i + width <= n; i += width)                                    \
+            store(c + i, pre##_sub_epi32(load(a + i), load(b + i)));          \
+        scalar_kernels::sub(a + i, b + i, c + i, n - i);                      \
+    }                                                                         \
+    __attribute__((target(isa))) void mul(                                   \
+            const int *a, const int *b, int *c, size_t n) {                   \
+        size_t i = 0;                                                         \
+        for (; i + width <= n; i += width)                                    \
+            store(c + i, pre##_mullo_epi32(load(a + i), load(b + i)));        \
+        scalar_kernels::mul(a + i, b + i, c + i, n - i);                      \
+    }                                                                         \
+    __attribute__((target(isa))) void cmp(                                   \
+            const int *a, const int *b, int *c, size_t n) {                   \
+        const vec one = pre##_set1_epi32(1);                                  \
+        size_t i = 0;                                                         \
+        for (; i + width <= n; i += width)                                    \
+            store(c + i,                                                      \
+                  pre##_and_##suffix(                                         \
+                          pre##_cmpeq_epi32(load(a + i), load(b + i)), one)); \
+        scalar_kernels::cmp(a + i, b + i, c + i, n - i);                      \
+    }                                                                         \
+    __attribute__((target(isa))) int sum(const int *a, size_t n) {            \
+        vec acc = pre##_setzero_##suffix();                                   \
+        size_t i = 0;                                                         \
+        for (; i + width <= n; i += width)                                    \
+            acc = pre##_add_epi32(acc, load(a + i));                          \
+        int lanes[width];                                                     \
+        store(lanes, acc);                                                    \
+        return static_cast<unsigned>(scalar_kernels::sum(lanes, width)) +     \
+               static_cast<unsigned>(scalar_kernels::sum(a + i, n - i));      \
+    }                                                                         \
+    __attribute__((target(isa))) int max(const int *a, size_t n) {            \
+        vec acc = pre##_set1_epi32(INT_MIN);                                  \
+        size_t i = 0;                                                         \
+        for (; i + width <= n; i += width)                                    \
+            acc = pre##_max_epi32(acc, load(a + i));                          \
+        int lanes[width];                                                     \
+        store(lanes, acc);                                                    \
+        int head = scalar_kernels::max(lanes, width);                         \
+        int tail = scalar_kernels::max(a + i, n - i);                         \
+        return head > tail ? head : tail;                                     \
+    }                                                                         \
+    }  // namespace ns
+
+IMPLEMENT_VECTOR_KERNELS(sse_kernels, "sse4.1", __m128i, 4, _mm, si128)
+IMPLEMENT_VECTOR_KERNELS(avx2_kernels, "avx2", __m256i, 8, _mm256, si256)
+
+#undef IMPLEMENT_VECTOR_KERNELS
+
+#endif  // IF VECTOR_X86
 
-        env->memory[GET(index)] = GET(value1) * GET(value2);
+/**
+ * Select the best kernels supported by current CPU
+ * @return Kernel table, resolved once
+ */
+inline const VectorKernels &vector_kernels() {
+#define SELECT_KERNELS(ns)                                         \
+    { ns::add, ns::sub, ns::mul, ns::cmp, ns::sum, ns::max }
 
-        return 0;
-    }
+    static const VectorKernels kernels = []() -> VectorKernels {
+#if VECTOR_X86
+        __builtin_cpu_init();
 
-    IMPLEMENT_BASIS(MulArgs)
-};  // class MulInstruction
+        if (__builtin_cpu_supports("avx2"))
+            return SELECT_KERNELS(avx2_kernels);
+        if (__builtin_cpu_supports("sse4.1"))
+            return SELECT_KERNELS(sse_kernels);
+#endif  // IF VECTOR_X86
 
-class DivInstruction final : public Instruction {
- public:
-    struct DivArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct DivArgs
+        return SELECT_KERNELS(scalar_kernels);
+    }();
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const DivArgs *>(_args);
-        DEBUGF("DIV %d %d %d", GET(value1), GET(value2), GET(index))
+#undef SELECT_KERNELS
 
-        env->memory[GET(index)] = GET(value1) / GET(value2);
+    return kernels;
+}
 
-        return 0;
-    }
+/**
+ * Test whether SIMD kernels produce the same result as sequential processing
+ * @param  dst Destination range
+ * @param  src Source range
+ * @param  n   Length of both ranges
+ * @return     false if `dst` starts inside `src` after its first element
+ */
+inline bool vector_safe(const int *dst, const int *src, const size_t n) {
+    return dst <= src || dst >= src + n;
+}
 
-    IMPLEMENT_BASIS(DivArgs)
-};  // class DivInstruction
+/////////////
+// STREAMS //
+/////////////
 
-class ModInstruction final : public Instruction {
+/**
+ * Source of `IN`
+ */
+class InputStream {
  public:
-    struct ModArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct ModArgs
-
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const ModArgs *>(_args);
-        DEBUGF("MOD %d %d %d", GET(value1), GET(value2), GET(index))
+    enum Result {
+        Ready,  // A value is read
+        Empty,  // No value is available yet
+        End     // No value will ever be available
+    };  // enum Result
 
-        env->memory[GET(index)] = GET(value1) % GET(value2);
+    virtual ~InputStream();
 
-        return 0;
-    }
+    /**
+     * Read the next integer
+     * @param  value Target
+     * @return       Whether `value` is read
+     */
+    virtual Result read(int &value) = 0;
+};  // class InputStream
 
-    IMPLEMENT_BASIS(ModArgs)
-};  // class ModInstruction
+InputStream::~InputStream() = default;
 
-class IncInstruction final : public Instruction {
+/**
+ * Destination of `OUT`
+ */
+class OutputStream {
  public:
-    struct IncArgs {
-        Value value;
-        Value index;
-    };  // struct IncArgs
+    virtual ~OutputStream();
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const IncArgs *>(_args);
-        DEBUGF("INC %d %d", GET(value), GET(index))
+    /**
+     * Write one integer
+     * @param  value Integer
+     * @return       false if the stream is full and `value` is not written
+     */
+    virtual bool write(const int value) = 0;
+};  // class OutputStream
 
-        env->memory[GET(index)] = GET(value) + 1;
+OutputStream::~OutputStream() = default;
 
-        return 0;
+class FileInput final : public InputStream {
+ public:
+    FileInput(FILE *file) : file(file) {}
+
+    virtual Result read(int &value) {
+        return fscanf(file, "%d", &value) == 1 ? Ready : End;
     }
 
-    IMPLEMENT_BASIS(IncArgs)
-};  // class IncInstruction
+    FILE *file;
+};  // class FileInput
 
-class DecInstruction final : public Instruction {
+class FileOutput final : public OutputStream {
  public:
-    struct DecArgs {
-        Value value;
-        Value index;
-    };  // struct DecArgs
-
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const DecArgs *>(_args);
-        DEBUGF("DEC %d %d", GET(value), GET(index))
+    FileOutput(FILE *file) : file(file) {}
 
-        env->memory[GET(index)] = GET(value) - 1;
+    virtual bool write(const int value) {
+        fprintf(file, "%d\n", value);
 
-        return 0;
+        return true;
     }
 
-    IMPLEMENT_BASIS(DecArgs)
-};  // class DecInstruction
+    FILE *file;
+};  // class FileOutput
 
-class NecInstruction final : public Instruction {
+class TextOutput final : public OutputStream {
  public:
-    struct NecArgs {
-        Value value;
-        Value index;
-    };  // struct NecArgs
-
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const NecArgs *>(_args);
-        DEBUGF("NEC %d %d", GET(value), GET(index))
-
-        env->memory[GET(index)] = -GET(value);
+    virtual bool write(const int value) {
+        char buffer[16];
+        text.append(buffer, snprintf(buffer, sizeof(buffer), "%d\n", value));
 
-        return 0;
+        return true;
     }
 
-    IMPLEMENT_BASIS(NecArgs)
-};  // class NecInstruction
+    string text;
+};  // class TextOutput
 
-class AndInstruction final : public Instruction {
+/**
+ * Input filled by the host while the program is running
+ * `IN` blocks while the buffer is empty and the buffer is not closed.
+ */
+class BufferInput final : public InputStream {
  public:
-    struct AndArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct AndArgs
+    BufferInput() : _closed(false) {}
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const AndArgs *>(_args);
-        DEBUGF("AND %d %d %d", GET(value1), GET(value2), GET(index))
+    /**
+     * Append one value
+     * @param value Integer
+     */
+    void push(const int value) {
+        if (!_closed)
+            _values.push_back(value);
+    }
 
-        env->memory[GET(index)] = GET(value1) & GET(value2);
+    /**
+     * Append text that may end in the middle of a number
+     * @param text Characters
+     * @param size Number of characters
+     * @remark Like `scanf`, input ends at the first malformed number
+     */
+    void feed(const char *text, const size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            if (isspace(text[i]))
+                flush();
+            else
+                _partial += text[i];
+        }  // for
+    }
 
-        return 0;
+    /**
+     * Mark the end of input
+     */
+    void close() {
+        flush();
+        _closed = true;
     }
 
-    IMPLEMENT_BASIS(AndArgs)
-};  // class AndInstruction
+    virtual Result read(int &value) {
+        if (_values.empty())
+            return _closed ? End : Empty;
 
-class OrInstruction final : public Instruction {
- public:
-    struct OrArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct OrArgs
+        value = _values.front();
+        _values.pop_front();
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const OrArgs *>(_args);
-        DEBUGF("OR %d %d %d", GET(value1), GET(value2), GET(index))
+        return Ready;
+    }
 
-        env->memory[GET(index)] = GET(value1) | GET(value2);
+ private:
+    void flush() {
+        if (_partial.empty())
+            return;
+
+        char *end;
+        long long value = strtoll(_partial.c_str(), &end, 10);
+        if (*end == '\0')
+            push(value);
+        else
+            _closed = true;
 
-        return 0;
+        _partial.clear();
     }
 
-    IMPLEMENT_BASIS(OrArgs)
-};  // class OrInstruction
+    deque<int> _values;
+    string _partial;
+    bool _closed;
+};  // class BufferInput
 
-class XorInstruction final : public Instruction {
+/**
+ * Lock-free single-producer single-consumer queue of integers
+ * A side finding the queue empty or full can sleep in `wait_readable` or
+ * `wait_writable`. The other side only takes the lock when someone sleeps.
+ */
+class RingBuffer {
  public:
-    struct XorArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct XorArgs
+    /**
+     * Capacity, must be a power of 2
+     */
+    constexpr static size_t Capacity = 1 << 12;
+
+    RingBuffer()
+            : _head(0),
+              _tail(0),
+              _writer_closed(false),
+              _reader_closed(false),
+              _sleeping(0) {}
+
+    // Plain `new` only aligns to 16 bytes before C++17
+    static void *operator new(size_t size) {
+        void *p;
+        if (posix_memalign(&p, alignof(RingBuffer), size) != 0)
+            throw bad_alloc();
+        return p;
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const XorArgs *>(_args);
-        DEBUGF("XOR %d %d %d", GET(value1), GET(value2), GET(index))
+    static void operator delete(void *p) {
+        free(p);
+    }
 
-        env->memory[GET(index)] = GET(value1) ^ GET(value2);
+    /**
+     * Append one value, called by the producer
+     * @return false if the queue is full
+     * @remark Values are dropped once the consumer has closed its side
+     */
+    bool push(const int value) {
+        size_t tail = _tail.load(memory_order_relaxed);
 
-        return 0;
+        if (tail - _head.load(memory_order_acquire) == Capacity)
+            return _reader_closed.load(memory_order_acquire);
+
+        _values[tail & (Capacity - 1)] = value;
+        _tail.store(tail + 1, memory_order_release);
+        notify();
+
+        return true;
     }
 
-    IMPLEMENT_BASIS(XorArgs)
-};  // class XorInstruction
+    /**
+     * Remove the first value, called by the consumer
+     * @return false if the queue is empty
+     */
+    bool pop(int &value) {
+        size_t head = _head.load(memory_order_relaxed);
 
-class FlipInstruction final : public Instruction {
- public:
-    struct FlipArgs {
-        Value value;
-        Value index;
-    };  // struct FlipArgs
+        if (head == _tail.load(memory_order_acquire))
+            return false;
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const FlipArgs *>(_args);
-        DEBUGF("FLIP %d %d", GET(value), GET(index))
+        value = _values[head & (Capacity - 1)];
+        _head.store(head + 1, memory_order_release);
+        notify();
 
-        env->memory[GET(index)] = ~(GET(value));
+        return true;
+    }
 
-        return 0;
+    /**
+     * Called by the producer after its last `push`
+     */
+    void close_writer() {
+        _writer_closed.store(true, memory_order_release);
+        notify();
     }
 
-    IMPLEMENT_BASIS(FlipArgs)
-};  // class FlipInstruction
+    /**
+     * Called by the consumer when it will not `pop` any more
+     */
+    void close_reader() {
+        _reader_closed.store(true, memory_order_release);
+        notify();
+    }
 
-class NotInstruction final : public Instruction {
- public:
-    struct NotArgs {
-        Value value;
-        Value index;
-    };  // struct NotArgs
+    bool writer_closed() const {
+        return _writer_closed.load(memory_order_acquire);
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const NotArgs *>(_args);
-        DEBUGF("NOT %d %d", GET(value), GET(index))
+    /**
+     * Block the consumer until the queue is not empty or the producer closed
+     */
+    void wait_readable() {
+        wait([this]() {
+            return _head.load(memory_order_relaxed) !=
+                           _tail.load(memory_order_acquire) ||
+                   writer_closed();
+        });
+    }
 
-        env->memory[GET(index)] = !GET(value);
+    /**
+     * Block the producer until the queue is not full or the consumer closed
+     */
+    void wait_writable() {
+        wait([this]() {
+            return _tail.load(memory_order_relaxed) -
+                                   _head.load(memory_order_acquire) <
+                           Capacity ||
+                   _reader_closed.load(memory_order_acquire);
+        });
+    }
 
-        return 0;
+ private:
+    // Producer and consumer indexes live on separate cache lines
+    alignas(64) atomic<size_t> _head;
+    alignas(64) atomic<size_t> _tail;
+    alignas(64) atomic<bool> _writer_closed;
+    atomic<bool> _reader_closed;
+    atomic<size_t> _sleeping;
+    mutex _lock;
+    condition_variable _changed;
+    int _values[Capacity];
+
+    template <typename TPredicate>
+    void wait(const TPredicate &ready) {
+        unique_lock<mutex> guard(_lock);
+        _sleeping++;
+        // Pairs with the fence in `notify`: either the sleeper sees the
+        // change or the other side sees the sleeper
+        atomic_thread_fence(memory_order_seq_cst);
+        _changed.wait(guard, ready);
+        _sleeping--;
     }
 
-    IMPLEMENT_BASIS(NotArgs)
-};  // class NotInstruction
+    void notify() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (_sleeping.load(memory_order_relaxed) == 0)
+            return;
 
-class ShlInstruction final : public Instruction {
- public:
-    struct ShlArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct ShlArgs
+        { lock_guard<mutex> guard(_lock); }
+        _changed.notify_all();
+    }
+};  // class RingBuffer
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const ShlArgs *>(_args);
-        DEBUGF("SHL %d %d %d", GET(value1), GET(value2), GET(index))
+class RingInput final : public InputStream {
+ public:
+    RingInput(RingBuffer *ring) : ring(ring) {}
 
-        env->memory[GET(index)] = GET(value1) << GET(value2);
+    virtual Result read(int &value) {
+        if (ring->pop(value))
+            return Ready;
 
-        return 0;
+        // Values pushed before closing must be seen after it
+        if (!ring->writer_closed())
+            return Empty;
+        return ring->pop(value) ? Ready : End;
     }
 
-    IMPLEMENT_BASIS(ShlArgs)
-};  // class ShlInstruction
+    RingBuffer *ring;
+};  // class RingInput
 
-class ShrInstruction final : public Instruction {
+class RingOutput final : public OutputStream {
  public:
-    struct ShrArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct ShrArgs
-
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const ShrArgs *>(_args);
-        DEBUGF("SHR %d %d %d", GET(value1), GET(value2), GET(index))
-
-        env->memory[GET(index)] = GET(value1) >> GET(value2);
+    RingOutput(RingBuffer *ring) : ring(ring) {}
 
-        return 0;
+    virtual bool write(const int value) {
+        return ring->push(value);
     }
 
-    IMPLEMENT_BASIS(ShrArgs)
-};  // class ShrInstruction
+    RingBuffer *ring;
+};  // class RingOutput
 
-#define INT_HIGHBIT (sizeof(int) * 8 - 1)
+////////////
+// REPLAY //
+////////////
 
-class RolInstruction final : public Instruction {
+/**
+ * Log of the nondeterministic parts of a run: the seed of `randint` and every
+ * value read by `IN`
+ * The log starts with the magic `MAL1`, followed by the fingerprint of the
+ * program and the seed as LEB128 varints, then one zigzag varint per value.
+ * Small values take one byte.
+ */
+class ExecutionLog {
  public:
-    struct RolArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct RolArgs
-
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const RolArgs *>(_args);
-        DEBUGF("ROL %d %d %d", GET(value1), GET(value2), GET(index))
+    /**
+     * Fingerprint of a program file, FNV-1a of its bytes
+     * @param  path Path of the program
+     * @return      uint64_t
+     */
+    static uint64_t fingerprint(const char *path) {
+        FILE *in = fopen(path, "r");
+        ASSERT(in != nullptr, "No ASM file found.");
 
-        int v = GET(value1);
-        int t = GET(value2) & INT_HIGHBIT;
-        for (int i = 0; i < t; i++)
-            v = (v << 1) | (v >> INT_HIGHBIT);
-        env->memory[GET(index)] = v;
+        uint64_t hash = 14695981039346656037ULL;
+        int c;
+        while ((c = getc(in)) != EOF)
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+        fclose(in);
 
-        return 0;
+        return hash;
     }
 
-    IMPLEMENT_BASIS(RolArgs)
-};  // class RolInstruction
-
-class RorInstruction final : public Instruction {
- public:
-    struct RorArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct RorArgs
-
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const RorArgs *>(_args);
-        DEBUGF("ROR %d %d %d", GET(value1), GET(value2), GET(index))
-
-        int v = GET(value1);
-        int t = GET(value2) & INT_HIGHBIT;
-        for (int i = 0; i < t; i++)
-            v = (v >> 1) | (v & (1 << INT_HIGHBIT));
-        env->memory[GET(index)] = v;
+ protected:
+    static const char Magic[4];
 
-        return 0;
+    static void put(string &buffer, uint64_t value) {
+        while (value >= 0x80) {
+            buffer.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }  // while
+        buffer.push_back(static_cast<char>(value));
     }
 
-    IMPLEMENT_BASIS(RorArgs)
-};  // class RorInstruction
-
-class EquInstruction final : public Instruction {
- public:
-    struct EquArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct EquArgs
+    static bool get(const string &buffer, size_t &pos, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; pos < buffer.size() && shift < 64; shift += 7) {
+            auto byte = static_cast<unsigned char>(buffer[pos++]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }  // for
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const EquArgs *>(_args);
-        DEBUGF("EQU %d %d %d", GET(value1), GET(value2), GET(index))
+        return false;
+    }
 
-        env->memory[GET(index)] = GET(value1) == GET(value2);
+    static uint64_t zigzag(const int value) {
+        return (static_cast<uint32_t>(value) << 1) ^
+               static_cast<uint32_t>(value >> 31);
+    }
 
-        return 0;
+    static int unzigzag(const uint64_t value) {
+        return static_cast<int>(static_cast<uint32_t>(value >> 1) ^
+                                -static_cast<uint32_t>(value & 1));
     }
+};  // class ExecutionLog
 
-    IMPLEMENT_BASIS(EquArgs)
-};  // class EquInstruction
+const char ExecutionLog::Magic[4] = { 'M', 'A', 'L', '1' };
 
-class GterInstruction final : public Instruction {
+/**
+ * Input passing the values of another input through and appending them to a
+ * log
+ * The log is flushed when the recorder is destroyed, so runs ending with an
+ * error are recorded too.
+ */
+class RecordInput final : public InputStream, private ExecutionLog {
  public:
-    struct GterArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct GterArgs
-
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const GterArgs *>(_args);
-        DEBUGF("GTER %d %d %d", GET(value1), GET(value2), GET(index))
-
-        env->memory[GET(index)] = GET(value1) > GET(value2);
+    /**
+     * @param source      Input being recorded
+     * @param path        Path of the log
+     * @param fingerprint Fingerprint of the program
+     * @param seed        Seed of `randint`
+     */
+    RecordInput(InputStream *source,
+                const char *path,
+                const uint64_t fingerprint,
+                const uint32_t seed)
+            : source(source), _log(fopen(path, "w")) {
+        ASSERT(_log != nullptr, "Cannot open log file");
+
+        _buffer.assign(Magic, sizeof(Magic));
+        put(_buffer, fingerprint);
+        put(_buffer, seed);
+    }
 
-        return 0;
+    ~RecordInput() {
+        flush();
+        fclose(_log);
     }
 
-    IMPLEMENT_BASIS(GterArgs)
-};  // class GterInstruction
+    virtual Result read(int &value) {
+        Result result = source->read(value);
+        if (result == Ready) {
+            put(_buffer, zigzag(value));
+            if (_buffer.size() >= BufferSize)
+                flush();
+        }
 
-class LessInstruction final : public Instruction {
- public:
-    struct LessArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct LessArgs
+        return result;
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const LessArgs *>(_args);
-        DEBUGF("LESS %d %d %d", GET(value1), GET(value2), GET(index))
+    InputStream *source;
 
-        env->memory[GET(index)] = GET(value1) < GET(value2);
+ private:
+    constexpr static size_t BufferSize = 1 << 16;
 
-        return 0;
+    void flush() {
+        fwrite(_buffer.data(), 1, _buffer.size(), _log);
+        fflush(_log);
+        _buffer.clear();
     }
 
-    IMPLEMENT_BASIS(LessArgs)
-};  // class LessInstruction
+    FILE *_log;
+    string _buffer;
+};  // class RecordInput
 
-class GeqInstruction final : public Instruction {
+/**
+ * Input reading the values of a log
+ * The whole log is loaded at once, so `IN` never waits for a terminal or a
+ * file. `End` follows the last recorded value, as it did when recording.
+ */
+class ReplayInput final : public InputStream, private ExecutionLog {
  public:
-    struct GeqArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct GeqArgs
+    /**
+     * @param path        Path of the log
+     * @param fingerprint Fingerprint of the program to replay
+     */
+    ReplayInput(const char *path, const uint64_t fingerprint) : _pos(0) {
+        FILE *in = fopen(path, "r");
+        CHECK(in != nullptr, InvalidArgument, "No log file found");
+
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+            _buffer.append(buffer, n);
+        fclose(in);
+
+        uint64_t recorded, seed;
+        CHECK(_buffer.compare(0, sizeof(Magic), Magic, sizeof(Magic)) == 0,
+              InvalidArgument,
+              "Invalid log file");
+        _pos = sizeof(Magic);
+        CHECK(get(_buffer, _pos, recorded) && get(_buffer, _pos, seed),
+              InvalidArgument,
+              "Invalid log file");
+        CHECK(recorded == fingerprint,
+              InvalidArgument,
+              "Log file was recorded with another program");
+        _seed = seed;
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const GeqArgs *>(_args);
-        DEBUGF("GEQ %d %d %d", GET(value1), GET(value2), GET(index))
+    /**
+     * Seed of `randint` in the recorded run
+     * @return uint32_t
+     */
+    uint32_t seed() const {
+        return _seed;
+    }
 
-        env->memory[GET(index)] = GET(value1) >= GET(value2);
+    virtual Result read(int &value) {
+        uint64_t encoded;
+        if (!get(_buffer, _pos, encoded))
+            return End;
 
-        return 0;
+        value = unzigzag(encoded);
+        return Ready;
     }
 
-    IMPLEMENT_BASIS(GeqArgs)
-};  // class GeqInstruction
+ private:
+    string _buffer;
+    size_t _pos;
+    uint32_t _seed;
+};  // class ReplayInput
 
-class LeqInstruction final : public Instruction {
- public:
-    struct LeqArgs {
-        Value value1;
-        Value value2;
-        Value index;
-    };  // struct LeqArgs
+/////////////////
+// INSTRUCTION //
+/////////////////
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const LeqArgs *>(_args);
-        DEBUGF("LEQ %d %d %d", GET(value1), GET(value2), GET(index))
+class Environment;
 
-        env->memory[GET(index)] = GET(value1) <= GET(value2);
+class Instruction {
+ public:
+    /**
+     * Operation codes, shared by `NOP` and tagged `NOP`
+     */
+    enum Opcode {
+        NOP, MEM, IN, OUT, SET,
+        ADD, SUB, MUL, DIV, MOD, INC, DEC, NEC,
+        AND, OR, XOR, FLIP, NOT, SHL, SHR, ROL, ROR,
+        EQU, GTER, LESS, GEQ, LEQ,
+        JMP, JMOV, JIF, JIFM,
+        VADD, VSUB, VMUL, VCMP, VSUM, VMAX,
+        SPAWN, JOIN, CAS, FADD, XCHG,
+        OpcodeCount
+    };  // enum Opcode
 
-        return 0;
+    /**
+     * Return the mnemonic of an opcode
+     * @param  code Opcode
+     * @return      Name such as "ADD"
+     */
+    static const char *name(const Opcode code) {
+        static const char *const names[OpcodeCount] = {
+            "NOP", "MEM", "IN", "OUT", "SET",
+            "ADD", "SUB", "MUL", "DIV", "MOD", "INC", "DEC", "NEC",
+            "AND", "OR", "XOR", "FLIP", "NOT", "SHL", "SHR", "ROL", "ROR",
+            "EQU", "GTER", "LESS", "GEQ", "LEQ",
+            "JMP", "JMOV", "JIF", "JIFM",
+            "VADD", "VSUB", "VMUL", "VCMP", "VSUM", "VMAX",
+            "SPAWN", "JOIN", "CAS", "FADD", "XCHG"
+        };
+
+        return names[code];
     }
 
-    IMPLEMENT_BASIS(LeqArgs)
-};  // class LeqInstruction
+    virtual ~Instruction();
 
-class JmpInstruction final : public Instruction {
- public:
-    struct JmpArgs {
-        Value value;
-    };  // struct JmpArgs
+    /**
+     * `execute` interface
+     * @param  env   Execution state
+     * @param  _args Command arguments
+     * @return       Used time
+     */
+    virtual size_t execute(Environment *env, const void *_args) const = 0;
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const JmpArgs *>(_args);
-        DEBUGF("JMP %d", GET(value))
+    virtual void delete_args(const void *_args) const = 0;
 
-        env->current = GET(value);
+    virtual Opcode opcode() const = 0;
+};  // class Instruction
 
-        return 0;
-    }
+Instruction::~Instruction() = default;
 
-    IMPLEMENT_BASIS(JmpArgs)
-};  // class JmpInstruction
+////////////////
+// COST MODEL //
+////////////////
 
-class JmovInstruction final : public Instruction {
+/**
+ * Time charged for every opcode
+ * Weights are charged per basic block by `Program`. Vector instructions also
+ * return one unit per `VectorElements` elements from `execute`.
+ */
+class CostModel {
  public:
-    struct JmovArgs {
-        Value value;
-    };  // struct JmovArgs
+    /**
+     * Vector elements processed in one unit of time
+     */
+    constexpr static size_t VectorElements = 16;
+
+    CostModel() {
+        for (auto &weight : _weights)
+            weight = 1;
+
+        _weights[Instruction::MEM] = 0;
+        _weights[Instruction::IN] = 2;
+        _weights[Instruction::OUT] = 2;
+        _weights[Instruction::MUL] = 2;
+        _weights[Instruction::DIV] = 4;
+        _weights[Instruction::MOD] = 4;
+        _weights[Instruction::VADD] = 2;
+        _weights[Instruction::VSUB] = 2;
+        _weights[Instruction::VMUL] = 2;
+        _weights[Instruction::VCMP] = 2;
+        _weights[Instruction::VSUM] = 2;
+        _weights[Instruction::VMAX] = 2;
+        _weights[Instruction::SPAWN] = 8;
+        _weights[Instruction::CAS] = 2;
+        _weights[Instruction::FADD] = 2;
+        _weights[Instruction::XCHG] = 2;
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const JmovArgs *>(_args);
-        DEBUGF("JMOV %d", GET(value))
+    size_t operator[](const Instruction::Opcode code) const {
+        return _weights[code];
+    }
 
-        env->current += GET(value) - 1;
+    /**
+     * Read a table of weights
+     * Every line holds a mnemonic and its weight, like `DIV 10`. Opcodes not
+     * in the table keep their weight, `#` starts a comment.
+     * @param in Table
+     */
+    void load(FILE *in) {
+        char buffer[256];
+        for (int line = 1; fgets(buffer, sizeof(buffer), in); line++) {
+            char *comment = strchr(buffer, '#');
+            if (comment)
+                *comment = '\0';
+
+            char name[32];
+            long long weight;
+            int n = sscanf(buffer, "%31s %lld", name, &weight);
+            if (n <= 0)
+                continue;
+
+            int code = 0;
+            while (code < Instruction::OpcodeCount &&
+                   strcmp(name, opcode_name(code)) != 0)
+                code++;
+
+            Error error(Error::Syntax, "Invalid cost table");
+            error.position = line - 1;
+            if (n != 2 || weight < 0 || code == Instruction::OpcodeCount)
+                throw error;
+            _weights[code] = weight;
+        }  // for
+    }
 
-        return 0;
+ private:
+    static const char *opcode_name(const int code) {
+        return Instruction::name(static_cast<Instruction::Opcode>(code));
     }
 
-    IMPLEMENT_BASIS(JmovArgs)
-};  // class JmovInstruction
+    size_t _weights[Instruction::OpcodeCount];
+};  // class CostModel
 
-class JifInstruction final : public Instruction {
+/////////////
+// PROGRAM //
+/////////////
+
+/**
+ * Immutable program image
+ * A loaded program can be shared by any number of environments, including
+ * environments running on different threads.
+ */
+class Program {
  public:
-    struct JifArgs {
-        Value value1;
-        Value value2;
-    };  // struct JifArgs
+    /**
+     * Default time limit under the cost model, see `Environment::time_limit`
+     */
+    constexpr static size_t Timelimit = 50000000;
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const JifArgs *>(_args);
-        DEBUGF("JIF %d %d", GET(value1), GET(value2))
+    struct Command {
+        Instruction *instruction;
+        void *args;
 
-        if (GET(value1))
-            env->current = GET(value2);
+        bool is_valid() const {
+            return instruction != nullptr && args != nullptr;
+        }
+    };  // struct Command
 
-        return 0;
-    }
+    Program() = default;
+    Program(const Program &) = delete;
+    Program &operator=(const Program &) = delete;
 
-    IMPLEMENT_BASIS(JifArgs)
-};  // class JifInstruction
+    ~Program() {
+        for (auto &e : _commands) {
+            assert(e.args != nullptr);
 
-class JifmInstruction final : public Instruction {
- public:
-    struct JifmArgs {
+            e.instruction->delete_args(e.args);
+            delete e.instruction;
+        }  // foreach in _commands
+    }
+
+    /**
+     * Return the number of commands
+     * @return size_t
+     */
+    size_t size() const {
+        return _commands.size();
+    }
+
+    /**
+     * Return the opcode of a command
+     * @param  i Index of the command
+     * @return   Opcode
+     */
+    Instruction::Opcode opcode(const size_t i) const {
+        return _opcodes[i];
+    }
+
+    /**
+     * Return whether a command transfers control, i.e. ends a basic block
+     * @param  i Index of the command
+     * @return   Bool
+     */
+    bool ends_block(const size_t i) const {
+        return _block_end[i];
+    }
+
+    /**
+     * Return whether the program contains `SPAWN`
+     * @return Bool
+     */
+    bool threaded() const {
+        return _threaded;
+    }
+
+    /**
+     * Return the source line of a command
+     * @param  i Index of the command
+     * @return   Line number starting from 1, 0 if unknown
+     */
+    int line(const size_t i) const {
+        return _lines[i];
+    }
+
+    /**
+     * Append new command to the end of program
+     * @param command New command
+     * @param line    Source line of the command, 0 if unknown
+     */
+    void append(const Command &command, const int line = 0);
+
+    /**
+     * Replace the cost model, only before running
+     * @param model Weights of opcodes
+     */
+    void set_costs(const CostModel &model);
+
+    /**
+     * Result of `run`, `run_for` and `run_slice`
+     */
+    enum Status {
+        Exited,     // Program exited and all its threads ended
+        Exhausted,  // Budget used up
+        Blocked,    // `IN` found no input or `OUT` found the output full
+        Joining,    // Waiting for threads started by the environment
+        Failed      // Runtime error, stored in `Environment::error`
+    };  // enum Status
+
+    /**
+     * Run program until exited or failed
+     * @param  env Execution state prepared by `run_partical`
+     * @return     `Exited`, or `Failed` with the error in `env.error`
+     */
+    Status run(Environment &env) const;
+
+    /**
+     * Reset `env` and execute `MEM` and tagged `NOP` commands
+     * @param env Execution state
+     */
+    void run_partical(Environment &env) const;
+
+    /**
+     * Reset `env` to the state right after `run_partical`
+     * @param env Execution state whose memory has a snapshot taken right
+     * after `run_partical`
+     */
+    void rewind(Environment &env) const;
+
+    /**
+     * Run program for at most `budget` instructions
+     * Calling it again with the same environment resumes execution.
+     * @param  env    Execution state prepared by `run_partical`
+     * @param  budget Maximum number of instructions
+     * @return        Reason of stopping
+     * @remark `SPAWN` is not supported, such programs fail
+     */
+    Status run_for(Environment &env, const size_t budget) const;
+
+    /**
+     * Run program until `quantum` instructions passed and a basic block ended
+     * @param  env     Execution state
+     * @param  quantum Minimum number of instructions
+     * @return         Reason of stopping
+     */
+    Status run_slice(Environment &env, const size_t quantum) const;
+
+ private:
+    /**
+     * Loop of `run` for programs without `SPAWN`
+     * @param profiling Whether to fill `Environment::profile`
+     */
+    template <bool profiling>
+    Status run_serial(Environment &env) const;
+
+    /**
+     * Shared loop of `run_for` and `run_slice`
+     * @param preemptive Whether `budget` is checked at the end of basic blocks
+     * only, instead of before every instruction
+     * @param profiling  Whether to fill `Environment::profile`
+     */
+    template <bool preemptive, bool profiling>
+    Status execute(Environment &env, const size_t budget) const;
+
+    /**
+     * Reset position, timer and counters of `env`
+     */
+    void restart(Environment &env) const;
+
+    /**
+     * Cost charged by one call of `execute`, added to the shared timer when
+     * the call returns so threads do not contend on it every block
+     */
+    struct Charge {
+        Charge(atomic<size_t> &timer)
+                : timer(timer),
+                  base(timer.load(memory_order_relaxed)),
+                  spent(0) {}
+
+        ~Charge() {
+            timer.fetch_add(spent, memory_order_relaxed);
+        }
+
+        size_t passed() const {
+            return base + spent;
+        }
+
+        atomic<size_t> &timer;
+        size_t base;
+        size_t spent;
+    };  // struct Charge
+
+    /**
+     * Charge commands from `entry` to before `end`, then enforce limits
+     * The loops call it when control does not fall through to the next
+     * command, so a whole run of commands costs one subtraction of prefix
+     * sums and every loop iteration checks the limits once.
+     * @param end Position after the last executed command
+     */
+    void charge(Environment &env, Charge &charge, int &entry, int end) const;
+
+    /**
+     * Raise the error of an exceeded limit, kept out of the loops
+     */
+    [[noreturn]] __attribute__((noinline)) void exceed(
+            const Environment &env, const Charge &charge) const;
+
+    /**
+     * Weight of a command under the cost model, 0 for commands skipped while
+     * running
+     */
+    size_t weight(const size_t i) const;
+
+    vector<Command> _commands;
+
+    /**
+     * Whether a command transfers control, i.e. ends a basic block
+     */
+    vector<bool> _block_end;
+
+    vector<Instruction::Opcode> _opcodes;
+
+    /**
+     * Source line of every command, only read by reports
+     */
+    vector<int> _lines;
+
+    CostModel _model;
+
+    /**
+     * Prefix sums of weights: `_cost[i]` is the weight of commands before `i`,
+     * so a block entered at `p` and left at `e` costs `_cost[e + 1] - _cost[p]`
+     */
+    vector<size_t> _cost = vector<size_t>(1, 0);
+
+    /**
+     * Whether the program contains `SPAWN`
+     */
+    bool _threaded = false;
+};  // class Program
+
+//////////////
+// PROFILER //
+//////////////
+
+/**
+ * Execution counters of one environment
+ * Filled by the interpreter when `Environment::profile` is set. Every thread
+ * owns its profile, so the counters are plain integers; the scheduler merges
+ * the profiles of threads when they end.
+ */
+class Profile {
+ public:
+    /**
+     * The number of hottest commands in the text report
+     */
+    constexpr static size_t ReportedCommands = 20;
+
+    /**
+     * A jump from `source` to a position not after it, which closes a loop
+     * covering commands `target` to `source`
+     */
+    struct BackEdge {
+        int source;
+        int target;
+        size_t count;
+    };  // struct BackEdge
+
+    Profile(const Program &program)
+            : exact(true),
+              opcodes(),
+              commands(program.size()),
+              taken(program.size()),
+              _program(program) {}
+
+    /**
+     * Count one executed command
+     * @param code     Opcode of the command
+     * @param position Index of the command
+     * @param next     Position after the command
+     */
+    void record(const Instruction::Opcode code,
+                const int position,
+                const int next) {
+        opcodes[code]++;
+        commands[position]++;
+
+        if (Instruction::JMP <= code && code <= Instruction::JIFM) {
+            if (code == Instruction::JIF || code == Instruction::JIFM)
+                taken[position] += next != position + 1;
+            if (next <= position)
+                back_edges[edge_key(position, next)]++;
+        }
+    }
+
+    /**
+     * Add the counters of another profile of the same program
+     * @param other Profile
+     */
+    void merge(const Profile &other) {
+        for (size_t i = 0; i < Instruction::OpcodeCount; i++)
+            opcodes[i] += other.opcodes[i];
+
+        for (size_t i = 0; i < commands.size(); i++) {
+            commands[i] += other.commands[i];
+            taken[i] += other.taken[i];
+        }  // for
+
+        for (auto &e : other.back_edges)
+            back_edges[e.first] += e.second;
+    }
+
+    /**
+     * Return the number of counted instructions
+     * @return size_t
+     */
+    size_t total() const {
+        size_t result = 0;
+        for (auto count : opcodes)
+            result += count;
+
+        return result;
+    }
+
+    /**
+     * Print opcodes sorted by count, the hottest commands and every
+     * conditional jump
+     * @param out Target file
+     */
+    void print(FILE *out) const {
+        size_t sum = max<size_t>(total(), 1);
+
+        fprintf(out, "%-8s %14s %7s\n", "opcode", "count", "share");
+        for (auto code : sorted_opcodes()) {
+            fprintf(out,
+                    "%-8s %14zu %6.2f%%\n",
+                    Instruction::name(code),
+                    opcodes[code],
+                    100.0 * opcodes[code] / sum);
+        }  // foreach in sorted_opcodes()
+
+        vector<size_t> hottest = sorted_commands();
+        if (hottest.size() > ReportedCommands)
+            hottest.resize(ReportedCommands);
+
+        fprintf(out,
+                "\n%-8s %-8s %14s %7s\n",
+                "command",
+                "opcode",
+                "count",
+                "share");
+        for (auto i : hottest) {
+            fprintf(out,
+                    "%-8zu %-8s %14zu %6.2f%%\n",
+                    i,
+                    Instruction::name(_program.opcode(i)),
+                    commands[i],
+                    100.0 * commands[i] / sum);
+        }  // foreach in hottest
+
+        if (!exact)
+            return;
+
+        fprintf(out,
+                "\n%-8s %-8s %14s %14s\n",
+                "branch",
+                "opcode",
+                "taken",
+                "not taken");
+        for (size_t i = 0; i < commands.size(); i++) {
+            if (!is_branch(i) || commands[i] == 0)
+                continue;
+
+            fprintf(out,
+                    "%-8zu %-8s %14zu %14zu\n",
+                    i,
+                    Instruction::name(_program.opcode(i)),
+                    taken[i],
+                    commands[i] - taken[i]);
+        }  // for
+    }
+
+    /**
+     * Print the same information as `print` as one JSON object, with every
+     * executed command
+     * @param out Target file
+     */
+    void print_json(FILE *out) const {
+        fprintf(out, "{\"instructions\": %zu, \"opcodes\": [", total());
+
+        const char *separator = "";
+        for (auto code : sorted_opcodes()) {
+            fprintf(out,
+                    "%s{\"opcode\": \"%s\", \"count\": %zu}",
+                    separator,
+                    Instruction::name(code),
+                    opcodes[code]);
+            separator = ", ";
+        }  // foreach in sorted_opcodes()
+
+        fprintf(out, "], \"commands\": [");
+        separator = "";
+        for (auto i : sorted_commands()) {
+            fprintf(out,
+                    "%s{\"command\": %zu, \"opcode\": \"%s\", \"count\": %zu",
+                    separator,
+                    i,
+                    Instruction::name(_program.opcode(i)),
+                    commands[i]);
+            if (exact && is_branch(i))
+                fprintf(out,
+                        ", \"taken\": %zu, \"not_taken\": %zu",
+                        taken[i],
+                        commands[i] - taken[i]);
+            fprintf(out, "}");
+            separator = ", ";
+        }  // foreach in sorted_commands()
+
+        fprintf(out, "]}\n");
+    }
+
+    /**
+     * Print source lines and loops sorted by the instructions they executed
+     * @param out Target file
+     */
+    void print_lines(FILE *out) const {
+        size_t sum = max<size_t>(total(), 1);
+
+        // Several commands never share a line, but lines may be unknown
+        unordered_map<int, size_t> per_line;
+        for (size_t i = 0; i < commands.size(); i++) {
+            if (commands[i])
+                per_line[_program.line(i)] += commands[i];
+        }  // for
+
+        vector<pair<int, size_t>> lines(per_line.begin(), per_line.end());
+        sort(lines.begin(),
+             lines.end(),
+             [](const pair<int, size_t> &a, const pair<int, size_t> &b) {
+                 return a.second > b.second ||
+                        (a.second == b.second && a.first < b.first);
+             });
+        if (lines.size() > ReportedCommands)
+            lines.resize(ReportedCommands);
+
+        fprintf(out, "%-8s %14s %7s\n", "line", "count", "share");
+        for (auto &e : lines) {
+            fprintf(out,
+                    "%-8d %14zu %6.2f%%\n",
+                    e.first,
+                    e.second,
+                    100.0 * e.second / sum);
+        }  // foreach in lines
+
+        if (!exact)
+            return;
+
+        fprintf(out,
+                "\n%-16s %14s %14s %7s\n",
+                "loop",
+                "iterations",
+                "count",
+                "share");
+        for (auto &loop : sorted_loops()) {
+            size_t count = body_count(loop);
+            char range[32];
+            snprintf(range,
+                     sizeof(range),
+                     "%d-%d",
+                     _program.line(loop.target),
+                     _program.line(loop.source));
+
+            fprintf(out,
+                    "%-16s %14zu %14zu %6.2f%%\n",
+                    range,
+                    loop.count,
+                    count,
+                    100.0 * count / sum);
+        }  // foreach in sorted_loops()
+    }
+
+    /**
+     * Print folded stacks for flame graph tools, one line per executed
+     * command: `name;loop 3-7;line 5 ADD count`, where loops are nested from
+     * the outermost
+     * @param out  Target file
+     * @param name Root frame, usually the path of the program
+     */
+    void print_folded(FILE *out, const char *name) const {
+        vector<BackEdge> loops = sorted_loops();
+        sort(loops.begin(),
+             loops.end(),
+             [](const BackEdge &a, const BackEdge &b) {
+                 return a.source - a.target > b.source - b.target;
+             });
+
+        for (size_t i = 0; i < commands.size(); i++) {
+            if (!commands[i])
+                continue;
+
+            fprintf(out, "%s", name);
+            for (auto &loop : loops) {
+                if (loop.target <= static_cast<int>(i) &&
+                    static_cast<int>(i) <= loop.source)
+                    fprintf(out,
+                            ";loop %d-%d",
+                            _program.line(loop.target),
+                            _program.line(loop.source));
+            }  // foreach in loops
+
+            fprintf(out,
+                    ";line %d %s %zu\n",
+                    _program.line(i),
+                    Instruction::name(_program.opcode(i)),
+                    commands[i]);
+        }  // for
+    }
+
+    /**
+     * Whether counters are executions rather than samples of a `Sampler`,
+     * which has no branch and loop counters
+     */
+    bool exact;
+
+    /**
+     * Executions of each opcode
+     */
+    size_t opcodes[Instruction::OpcodeCount];
+
+    /**
+     * Executions of each command
+     */
+    vector<size_t> commands;
+
+    /**
+     * Taken jumps of each `JIF` and `JIFM`
+     */
+    vector<size_t> taken;
+
+    /**
+     * Executions of backward jumps, keyed by `edge_key`
+     */
+    unordered_map<uint64_t, size_t> back_edges;
+
+ private:
+    static uint64_t edge_key(const int source, const int target) {
+        return static_cast<uint64_t>(static_cast<uint32_t>(source)) << 32 |
+               static_cast<uint32_t>(target);
+    }
+
+    /**
+     * Detected loops, the ones executing most instructions first
+     * Back edges closing the same range are merged.
+     */
+    vector<BackEdge> sorted_loops() const {
+        vector<BackEdge> result;
+        for (auto &e : back_edges) {
+            result.push_back({ static_cast<int>(e.first >> 32),
+                               static_cast<int>(e.first & 0xFFFFFFFF),
+                               e.second });
+        }  // foreach in back_edges
+
+        stable_sort(result.begin(),
+                    result.end(),
+                    [this](const BackEdge &a, const BackEdge &b) {
+                        size_t x = body_count(a), y = body_count(b);
+                        return x > y || (x == y && a.source < b.source);
+                    });
+
+        return result;
+    }
+
+    /**
+     * Instructions executed by the commands inside a loop
+     */
+    size_t body_count(const BackEdge &loop) const {
+        size_t result = 0;
+        for (int i = max(loop.target, 0); i <= loop.source; i++)
+            result += commands[i];
+
+        return result;
+    }
+
+    bool is_branch(const size_t i) const {
+        return _program.opcode(i) == Instruction::JIF ||
+               _program.opcode(i) == Instruction::JIFM;
+    }
+
+    /**
+     * Executed opcodes, most frequent first
+     */
+    vector<Instruction::Opcode> sorted_opcodes() const {
+        vector<Instruction::Opcode> result;
+        for (size_t i = 0; i < Instruction::OpcodeCount; i++) {
+            if (opcodes[i])
+                result.push_back(static_cast<Instruction::Opcode>(i));
+        }  // for
+
+        stable_sort(result.begin(),
+                    result.end(),
+                    [this](Instruction::Opcode a, Instruction::Opcode b) {
+                        return opcodes[a] > opcodes[b];
+                    });
+
+        return result;
+    }
+
+    /**
+     * Executed commands, most frequent first
+     */
+    vector<size_t> sorted_commands() const {
+        vector<size_t> result;
+        for (size_t i = 0; i < commands.size(); i++) {
+            if (commands[i])
+                result.push_back(i);
+        }  // for
+
+        stable_sort(result.begin(), result.end(), [this](size_t a, size_t b) {
+            return commands[a] > commands[b];
+        });
+
+        return result;
+    }
+
+    const Program &_program;
+};  // class Profile
+
+/////////////////
+// ENVIRONMENT //
+/////////////////
+
+class Scheduler;
+
+/**
+ * Per-execution state of a program: memory, position, timer and I/O
+ * Threads started by `SPAWN` get their own environment sharing memory, I/O
+ * and the timer of the environment that started the program.
+ */
+class Environment {
+ public:
+    /**
+     * The maximum number of running threads in one program
+     */
+    constexpr static size_t MaxThreads = 1 << 20;
+
+    /**
+     * Default number of instructions a thread runs before being preempted
+     */
+    constexpr static size_t DefaultQuantum = 10000;
+
+    Environment(const Program &program)
+            : program(&program),
+              memory(_memory),
+              current(0),
+              executed(0),
+              input(&_file_input),
+              output(&_file_output),
+              profile(nullptr),
+              workers(thread::hardware_concurrency()),
+              quantum(DefaultQuantum),
+              time_limit(Program::Timelimit),
+              _group(&_own_group),
+              _parent(nullptr),
+              _pending(0),
+              _parked(false),
+              _wait(NoWait),
+              _executing(0),
+              _file_input(stdin),
+              _file_output(stdout) {}
+
+    /**
+     * Create the environment of a thread
+     * @param parent Environment executing `SPAWN`
+     * @param entry  Position of the first command
+     */
+    Environment(Environment &parent, const int entry)
+            : program(parent.program),
+              memory(parent.memory),
+              current(entry),
+              executed(0),
+              input(parent.input),
+              output(parent.output),
+              profile(nullptr),
+              workers(parent.workers),
+              quantum(parent.quantum),
+              time_limit(parent.time_limit),
+              _group(parent._group),
+              _parent(&parent),
+              _pending(0),
+              _parked(false),
+              _wait(NoWait),
+              _executing(entry),
+              _file_input(nullptr),
+              _file_output(nullptr) {
+        if (parent.profile) {
+            _own_profile.reset(new Profile(*program));
+            profile = _own_profile.get();
+        }
+    }
+
+    /**
+     * Indicate that whether the program has exited
+     * @return Bool
+     */
+    bool exited() const {
+        return current >= static_cast<int>(program->size());
+    }
+
+    /**
+     * Return the timer
+     * @return size_t
+     */
+    size_t passed_time() const {
+        return _group->timer.load(memory_order_relaxed);
+    }
+
+    /**
+     * Return the number of instructions executed by this environment and all
+     * threads it started that have ended
+     * @return size_t
+     */
+    size_t instruction_count() const {
+        return executed + _group->executed.load(memory_order_relaxed);
+    }
+
+    /**
+     * Use files as input and output
+     * @param in  Input file
+     * @param out Output file
+     */
+    void open(FILE *in, FILE *out) {
+        _file_input.file = in;
+        _file_output.file = out;
+        input = &_file_input;
+        output = &_file_output;
+    }
+
+    /**
+     * Make all threads of the program fail at the end of their current basic
+     * block
+     * @remark Safe to call from any thread
+     */
+    void stop() {
+        _group->stopped.store(true, memory_order_relaxed);
+    }
+
+    /**
+     * Block on `IN` or `OUT` until the stream is ready
+     */
+    void wait_io() {
+        _wait = IOWait;
+    }
+
+    /**
+     * Record a runtime error
+     * @param e        Error raised by the instruction
+     * @param position Command being executed
+     */
+    void fail(const Error &e, const int position) {
+        error = e;
+        error.position = position;
+        error.instructions = instruction_count();
+    }
+
+    /**
+     * Start a thread at `entry`
+     * @param entry Position of the first command
+     */
+    void spawn(const int entry);
+
+    /**
+     * Test whether all threads started by this environment have ended
+     * @return Bool
+     * @remark If not, the environment is blocked until they end
+     */
+    bool join();
+
+    const Program *program;
+
+ private:
+    MemoryPool _memory;
+
+ public:
+    MemoryPool &memory;
+    int current;
+
+    /**
+     * Number of instructions executed by this thread
+     */
+    size_t executed;
+
+    InputStream *input;
+    OutputStream *output;
+
+    /**
+     * Runtime error after `Program::Failed`
+     */
+    Error error;
+
+    /**
+     * Counters filled while running, NULL to disable profiling
+     */
+    Profile *profile;
+
+    /**
+     * Number of OS threads used to run `SPAWN` threads
+     */
+    size_t workers;
+
+    /**
+     * Number of instructions a thread runs before being preempted
+     */
+    size_t quantum;
+
+    /**
+     * Maximum time of the program under the cost model
+     */
+    size_t time_limit;
+
+ private:
+    friend class Program;
+    friend class Scheduler;
+    friend class Sampler;
+    friend class Checkpointer;
+    friend class Debugger;
+
+    /**
+     * State shared by all threads of one program
+     */
+    struct Group {
+        Group()
+                : timer(0),
+                  executed(0),
+                  threads(1),
+                  stopped(false),
+                  scheduler(nullptr) {}
+
+        atomic<size_t> timer;
+        atomic<size_t> executed;
+        atomic<size_t> threads;
+        atomic<bool> stopped;
+        Scheduler *scheduler;
+    };  // struct Group
+
+    Group _own_group;
+    Group *_group;
+    Environment *_parent;
+    atomic<size_t> _pending;
+    atomic<bool> _parked;
+
+    enum Wait { NoWait, JoinWait, IOWait };
+    Wait _wait;
+
+    /**
+     * Command being executed, read by the signal handler of `Sampler`
+     * `current` is not enough since it points to the next command while a
+     * command executes and to the target right after a jump.
+     */
+    volatile int _executing;
+
+    FileInput _file_input;
+    FileOutput _file_output;
+
+    /**
+     * Profile of a thread, merged into the root profile when it ends
+     */
+    unique_ptr<Profile> _own_profile;
+};  // class Environment
+
+/////////////////////////////////
+// INSTRUCTION IMPLEMENTATIONS //
+/////////////////////////////////
+
+#define GET(name) args->name.get(&env->memory)
+#define IMPLEMENT_BASIS(args_type, code)                        \
+    virtual void delete_args(const void *_args) const {         \
+        auto args = reinterpret_cast<const args_type *>(_args); \
+        delete args;                                            \
+    }                                                           \
+    virtual Opcode opcode() const {                             \
+        return code;                                            \
+    }                                                           \
+    typedef args_type ArgsType;
+
+class NopInstruction final : public Instruction {
+ public:
+    struct NopArgs {};  // struct NopArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const NopArgs *>(_args);
+        DEBUG("NOP")
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(NopArgs, NOP)
+};  // class NopInstruction
+
+class TaggedNopInstruction final : public Instruction {
+ public:
+    struct TaggedNopArgs {
+        Value index;
+    };  // struct TaggedNopArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const TaggedNopArgs *>(_args);
+        DEBUGF("NOP %d", GET(index))
+
+        env->memory[GET(index)] = env->current;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(TaggedNopArgs, NOP)
+};  // class TaggedNopInstruction
+
+class MemInstruction final : public Instruction {
+ public:
+    struct MemArgs {
+        Value value;
+    };  // struct MemArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const MemArgs *>(_args);
+        DEBUGF("MEM %d", GET(value))
+
+        env->memory.resize(GET(value));
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(MemArgs, MEM)
+};  // class MemInstruction
+
+class InInstruction final : public Instruction {
+ public:
+    struct InArgs {
+        Value index;
+    };  // struct InArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const InArgs *>(_args);
+        DEBUGF("IN %d", GET(index))
+
+        int result;
+        switch (env->input->read(result)) {
+            case InputStream::Ready: break;
+            case InputStream::Empty:
+                env->wait_io();
+                env->current--;
+                return 0;
+            case InputStream::End:
+#if FRIENDLY_MODE
+                result = 0;
+#else
+                result = randint();
+#endif  // IF FRIENDLY_MODE
+                break;
+        }  // switch
+
+        env->memory[GET(index)] = result;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(InArgs, IN)
+};  // class InInstruction
+
+class OutInstruction final : public Instruction {
+ public:
+    struct OutArgs {
+        Value value;
+    };  // struct OutArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const OutArgs *>(_args);
+        DEBUGF("OUT %d", GET(value))
+
+        if (!env->output->write(GET(value))) {
+            env->wait_io();
+            env->current--;
+        }
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(OutArgs, OUT)
+};  // class OutInstruction
+
+class SetInstruction final : public Instruction {
+ public:
+    struct SetArgs {
+        Value value;
+        Value index;
+    };  // struct SetArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const SetArgs *>(_args);
+        DEBUGF("SET %d %d", GET(value), GET(index))
+
+        env->memory[GET(index)] = GET(value);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(SetArgs, SET)
+};  // class SetInstruction
+
+class AddInstruction final : public Instruction {
+ public:
+    struct AddArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct AddArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const AddArgs *>(_args);
+        DEBUGF("ADD %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) + GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(AddArgs, ADD)
+};  // class AddInstruction
+
+class SubInstruction final : public Instruction {
+ public:
+    struct SubArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct SubArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const SubArgs *>(_args);
+        DEBUGF("SUB %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) - GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(SubArgs, SUB)
+};  // class SubInstruction
+
+class MulInstruction final : public Instruction {
+ public:
+    struct MulArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct MulArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const MulArgs *>(_args);
+        DEBUGF("MUL %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) * GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(MulArgs, MUL)
+};  // class MulInstruction
+
+class DivInstruction final : public Instruction {
+ public:
+    struct DivArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct DivArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const DivArgs *>(_args);
+        DEBUGF("DIV %d %d %d", GET(value1), GET(value2), GET(index))
+
+        int divisor = GET(value2);
+        CHECK(divisor != 0, Arithmetic, "Division by zero");
+        CHECK(divisor != -1 || GET(value1) != INT_MIN,
+              Arithmetic,
+              "Integer overflow");
+
+        env->memory[GET(index)] = GET(value1) / divisor;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(DivArgs, DIV)
+};  // class DivInstruction
+
+class ModInstruction final : public Instruction {
+ public:
+    struct ModArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct ModArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const ModArgs *>(_args);
+        DEBUGF("MOD %d %d %d", GET(value1), GET(value2), GET(index))
+
+        int divisor = GET(value2);
+        CHECK(divisor != 0, Arithmetic, "Division by zero");
+        CHECK(divisor != -1 || GET(value1) != INT_MIN,
+              Arithmetic,
+              "Integer overflow");
+
+        env->memory[GET(index)] = GET(value1) % divisor;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(ModArgs, MOD)
+};  // class ModInstruction
+
+class IncInstruction final : public Instruction {
+ public:
+    struct IncArgs {
+        Value value;
+        Value index;
+    };  // struct IncArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const IncArgs *>(_args);
+        DEBUGF("INC %d %d", GET(value), GET(index))
+
+        env->memory[GET(index)] = GET(value) + 1;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(IncArgs, INC)
+};  // class IncInstruction
+
+class DecInstruction final : public Instruction {
+ public:
+    struct DecArgs {
+        Value value;
+        Value index;
+    };  // struct DecArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const DecArgs *>(_args);
+        DEBUGF("DEC %d %d", GET(value), GET(index))
+
+        env->memory[GET(index)] = GET(value) - 1;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(DecArgs, DEC)
+};  // class DecInstruction
+
+class NecInstruction final : public Instruction {
+ public:
+    struct NecArgs {
+        Value value;
+        Value index;
+    };  // struct NecArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const NecArgs *>(_args);
+        DEBUGF("NEC %d %d", GET(value), GET(index))
+
+        env->memory[GET(index)] = -GET(value);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(NecArgs, NEC)
+};  // class NecInstruction
+
+class AndInstruction final : public Instruction {
+ public:
+    struct AndArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct AndArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const AndArgs *>(_args);
+        DEBUGF("AND %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) & GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(AndArgs, AND)
+};  // class AndInstruction
+
+class OrInstruction final : public Instruction {
+ public:
+    struct OrArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct OrArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const OrArgs *>(_args);
+        DEBUGF("OR %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) | GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(OrArgs, OR)
+};  // class OrInstruction
+
+class XorInstruction final : public Instruction {
+ public:
+    struct XorArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct XorArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const XorArgs *>(_args);
+        DEBUGF("XOR %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) ^ GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(XorArgs, XOR)
+};  // class XorInstruction
+
+class FlipInstruction final : public Instruction {
+ public:
+    struct FlipArgs {
+        Value value;
+        Value index;
+    };  // struct FlipArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const FlipArgs *>(_args);
+        DEBUGF("FLIP %d %d", GET(value), GET(index))
+
+        env->memory[GET(index)] = ~(GET(value));
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(FlipArgs, FLIP)
+};  // class FlipInstruction
+
+class NotInstruction final : public Instruction {
+ public:
+    struct NotArgs {
+        Value value;
+        Value index;
+    };  // struct NotArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const NotArgs *>(_args);
+        DEBUGF("NOT %d %d", GET(value), GET(index))
+
+        env->memory[GET(index)] = !GET(value);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(NotArgs, NOT)
+};  // class NotInstruction
+
+class ShlInstruction final : public Instruction {
+ public:
+    struct ShlArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct ShlArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const ShlArgs *>(_args);
+        DEBUGF("SHL %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) << GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(ShlArgs, SHL)
+};  // class ShlInstruction
+
+class ShrInstruction final : public Instruction {
+ public:
+    struct ShrArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct ShrArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const ShrArgs *>(_args);
+        DEBUGF("SHR %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) >> GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(ShrArgs, SHR)
+};  // class ShrInstruction
+
+#define INT_HIGHBIT (sizeof(int) * 8 - 1)
+
+class RolInstruction final : public Instruction {
+ public:
+    struct RolArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct RolArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const RolArgs *>(_args);
+        DEBUGF("ROL %d %d %d", GET(value1), GET(value2), GET(index))
+
+        int v = GET(value1);
+        int t = GET(value2) & INT_HIGHBIT;
+        for (int i = 0; i < t; i++)
+            v = (v << 1) | (v >> INT_HIGHBIT);
+        env->memory[GET(index)] = v;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(RolArgs, ROL)
+};  // class RolInstruction
+
+class RorInstruction final : public Instruction {
+ public:
+    struct RorArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct RorArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const RorArgs *>(_args);
+        DEBUGF("ROR %d %d %d", GET(value1), GET(value2), GET(index))
+
+        int v = GET(value1);
+        int t = GET(value2) & INT_HIGHBIT;
+        for (int i = 0; i < t; i++)
+            v = (v >> 1) | (v & (1 << INT_HIGHBIT));
+        env->memory[GET(index)] = v;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(RorArgs, ROR)
+};  // class RorInstruction
+
+class EquInstruction final : public Instruction {
+ public:
+    struct EquArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct EquArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const EquArgs *>(_args);
+        DEBUGF("EQU %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) == GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(EquArgs, EQU)
+};  // class EquInstruction
+
+class GterInstruction final : public Instruction {
+ public:
+    struct GterArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct GterArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const GterArgs *>(_args);
+        DEBUGF("GTER %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) > GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(GterArgs, GTER)
+};  // class GterInstruction
+
+class LessInstruction final : public Instruction {
+ public:
+    struct LessArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct LessArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const LessArgs *>(_args);
+        DEBUGF("LESS %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) < GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(LessArgs, LESS)
+};  // class LessInstruction
+
+class GeqInstruction final : public Instruction {
+ public:
+    struct GeqArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct GeqArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const GeqArgs *>(_args);
+        DEBUGF("GEQ %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) >= GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(GeqArgs, GEQ)
+};  // class GeqInstruction
+
+class LeqInstruction final : public Instruction {
+ public:
+    struct LeqArgs {
+        Value value1;
+        Value value2;
+        Value index;
+    };  // struct LeqArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const LeqArgs *>(_args);
+        DEBUGF("LEQ %d %d %d", GET(value1), GET(value2), GET(index))
+
+        env->memory[GET(index)] = GET(value1) <= GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(LeqArgs, LEQ)
+};  // class LeqInstruction
+
+class JmpInstruction final : public Instruction {
+ public:
+    struct JmpArgs {
+        Value value;
+    };  // struct JmpArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const JmpArgs *>(_args);
+        DEBUGF("JMP %d", GET(value))
+
+        env->current = GET(value);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(JmpArgs, JMP)
+};  // class JmpInstruction
+
+class JmovInstruction final : public Instruction {
+ public:
+    struct JmovArgs {
+        Value value;
+    };  // struct JmovArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const JmovArgs *>(_args);
+        DEBUGF("JMOV %d", GET(value))
+
+        env->current += GET(value) - 1;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(JmovArgs, JMOV)
+};  // class JmovInstruction
+
+class JifInstruction final : public Instruction {
+ public:
+    struct JifArgs {
+        Value value1;
+        Value value2;
+    };  // struct JifArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const JifArgs *>(_args);
+        DEBUGF("JIF %d %d", GET(value1), GET(value2))
+
+        if (GET(value1))
+            env->current = GET(value2);
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(JifArgs, JIF)
+};  // class JifInstruction
+
+class JifmInstruction final : public Instruction {
+ public:
+    struct JifmArgs {
+        Value value1;
+        Value value2;
+    };  // struct JifmArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const JifmArgs *>(_args);
+        DEBUGF("JIFM %d %d", GET(value1), GET(value2))
+
+        if (GET(value1))
+            env->current += GET(value2) - 1;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(JifmArgs, JIFM)
+};  // class JifmInstruction
+
+/**
+ * Apply an element-wise kernel to ranges `source1`, `source2` and `target`
+ * @param  env        Execution state
+ * @param  args       Arguments with `source1`, `source2`, `target`, `length`
+ * @param  simd       Kernel used when ranges do not overlap harmfully
+ * @param  sequential Kernel used otherwise
+ * @return            Time used beyond the weight of the opcode
+ */
+template <typename TArgs>
+size_t vector_binary(Environment *env,
+                     const TArgs *args,
+                     VectorKernels::BinaryKernel simd,
+                     VectorKernels::BinaryKernel sequential) {
+    int length = GET(length);
+    CHECK(length >= 0, InvalidArgument, "Invalid vector length");
+
+    const int *a = env->memory.range(GET(source1), length);
+    const int *b = env->memory.range(GET(source2), length);
+    int *c = env->memory.range(GET(target), length);
+
+    if (vector_safe(c, a, length) && vector_safe(c, b, length))
+        simd(a, b, c, length);
+    else
+        sequential(a, b, c, length);
+
+    return length / CostModel::VectorElements;
+}
+
+class VaddInstruction final : public Instruction {
+ public:
+    struct VaddArgs {
+        Value source1;
+        Value source2;
+        Value target;
+        Value length;
+    };  // struct VaddArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const VaddArgs *>(_args);
+        DEBUGF("VADD %d %d %d %d",
+               GET(source1),
+               GET(source2),
+               GET(target),
+               GET(length))
+
+        return vector_binary(
+                env, args, vector_kernels().add, scalar_kernels::add);
+    }
+
+    IMPLEMENT_BASIS(VaddArgs, VADD)
+};  // class VaddInstruction
+
+class VsubInstruction final : public Instruction {
+ public:
+    struct VsubArgs {
+        Value source1;
+        Value source2;
+        Value target;
+        Value length;
+    };  // struct VsubArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const VsubArgs *>(_args);
+        DEBUGF("VSUB %d %d %d %d",
+               GET(source1),
+               GET(source2),
+               GET(target),
+               GET(length))
+
+        return vector_binary(
+                env, args, vector_kernels().sub, scalar_kernels::sub);
+    }
+
+    IMPLEMENT_BASIS(VsubArgs, VSUB)
+};  // class VsubInstruction
+
+class VmulInstruction final : public Instruction {
+ public:
+    struct VmulArgs {
+        Value source1;
+        Value source2;
+        Value target;
+        Value length;
+    };  // struct VmulArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const VmulArgs *>(_args);
+        DEBUGF("VMUL %d %d %d %d",
+               GET(source1),
+               GET(source2),
+               GET(target),
+               GET(length))
+
+        return vector_binary(
+                env, args, vector_kernels().mul, scalar_kernels::mul);
+    }
+
+    IMPLEMENT_BASIS(VmulArgs, VMUL)
+};  // class VmulInstruction
+
+class VcmpInstruction final : public Instruction {
+ public:
+    struct VcmpArgs {
+        Value source1;
+        Value source2;
+        Value target;
+        Value length;
+    };  // struct VcmpArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const VcmpArgs *>(_args);
+        DEBUGF("VCMP %d %d %d %d",
+               GET(source1),
+               GET(source2),
+               GET(target),
+               GET(length))
+
+        return vector_binary(
+                env, args, vector_kernels().cmp, scalar_kernels::cmp);
+    }
+
+    IMPLEMENT_BASIS(VcmpArgs, VCMP)
+};  // class VcmpInstruction
+
+class VsumInstruction final : public Instruction {
+ public:
+    struct VsumArgs {
+        Value source;
+        Value target;
+        Value length;
+    };  // struct VsumArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const VsumArgs *>(_args);
+        DEBUGF("VSUM %d %d %d", GET(source), GET(target), GET(length))
+
+        int length = GET(length);
+        CHECK(length >= 0, InvalidArgument, "Invalid vector length");
+
+        const int *a = env->memory.range(GET(source), length);
+        env->memory[GET(target)] = vector_kernels().sum(a, length);
+
+        return length / CostModel::VectorElements;
+    }
+
+    IMPLEMENT_BASIS(VsumArgs, VSUM)
+};  // class VsumInstruction
+
+class VmaxInstruction final : public Instruction {
+ public:
+    struct VmaxArgs {
+        Value source;
+        Value target;
+        Value length;
+    };  // struct VmaxArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const VmaxArgs *>(_args);
+        DEBUGF("VMAX %d %d %d", GET(source), GET(target), GET(length))
+
+        int length = GET(length);
+        CHECK(length > 0, InvalidArgument, "Invalid vector length");
+
+        const int *a = env->memory.range(GET(source), length);
+        env->memory[GET(target)] = vector_kernels().max(a, length);
+
+        return length / CostModel::VectorElements;
+    }
+
+    IMPLEMENT_BASIS(VmaxArgs, VMAX)
+};  // class VmaxInstruction
+
+class SpawnInstruction final : public Instruction {
+ public:
+    struct SpawnArgs {
+        Value value;
+    };  // struct SpawnArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const SpawnArgs *>(_args);
+        DEBUGF("SPAWN %d", GET(value))
+
+        env->spawn(GET(value));
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(SpawnArgs, SPAWN)
+};  // class SpawnInstruction
+
+class JoinInstruction final : public Instruction {
+ public:
+    struct JoinArgs {};  // struct JoinArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        DEBUG("JOIN")
+
+        if (!env->join())
+            env->current--;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(JoinArgs, JOIN)
+};  // class JoinInstruction
+
+class CasInstruction final : public Instruction {
+ public:
+    struct CasArgs {
+        Value cell;
         Value value1;
         Value value2;
-    };  // struct JifmArgs
+        Value index;
+    };  // struct CasArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const CasArgs *>(_args);
+        DEBUGF("CAS %d %d %d %d",
+               GET(cell),
+               GET(value1),
+               GET(value2),
+               GET(index))
+
+        int *cell = env->memory.range(GET(cell), 1);
+        int expected = GET(value1);
+        __atomic_compare_exchange_n(cell,
+                                    &expected,
+                                    GET(value2),
+                                    false,
+                                    __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST);
+        env->memory[GET(index)] = expected;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(CasArgs, CAS)
+};  // class CasInstruction
+
+class FaddInstruction final : public Instruction {
+ public:
+    struct FaddArgs {
+        Value cell;
+        Value value;
+        Value index;
+    };  // struct FaddArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const FaddArgs *>(_args);
+        DEBUGF("FADD %d %d %d", GET(cell), GET(value), GET(index))
+
+        int *cell = env->memory.range(GET(cell), 1);
+        int old = __atomic_fetch_add(cell, GET(value), __ATOMIC_SEQ_CST);
+        env->memory[GET(index)] = old;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(FaddArgs, FADD)
+};  // class FaddInstruction
+
+class XchgInstruction final : public Instruction {
+ public:
+    struct XchgArgs {
+        Value cell;
+        Value value;
+        Value index;
+    };  // struct XchgArgs
+
+    virtual size_t execute(Environment *env, const void *_args) const {
+        auto args = reinterpret_cast<const XchgArgs *>(_args);
+        DEBUGF("XCHG %d %d %d", GET(cell), GET(value), GET(index))
+
+        int *cell = env->memory.range(GET(cell), 1);
+        int old = __atomic_exchange_n(cell, GET(value), __ATOMIC_SEQ_CST);
+        env->memory[GET(index)] = old;
+
+        return 0;
+    }
+
+    IMPLEMENT_BASIS(XchgArgs, XCHG)
+};  // class XchgInstruction
+
+#undef GET
+#undef IMPLEMENT_BASIS
+
+void Program::append(const Command &command, const int line) {
+    ASSERT(command.is_valid(), "(internal) NULL command received");
+
+    const Instruction &instruction = *command.instruction;
+    _commands.push_back(command);
+    _lines.push_back(line);
+    _block_end.push_back(typeid(instruction) == typeid(JmpInstruction) ||
+                         typeid(instruction) == typeid(JmovInstruction) ||
+                         typeid(instruction) == typeid(JifInstruction) ||
+                         typeid(instruction) == typeid(JifmInstruction) ||
+                         typeid(instruction) == typeid(SpawnInstruction) ||
+                         typeid(instruction) == typeid(JoinInstruction) ||
+                         typeid(instruction) == typeid(InInstruction) ||
+                         typeid(instruction) == typeid(OutInstruction));
+    _opcodes.push_back(instruction.opcode());
+    _cost.push_back(_cost.back() + weight(_commands.size() - 1));
+
+    if (typeid(instruction) == typeid(SpawnInstruction))
+        _threaded = true;
+}
+
+void Program::set_costs(const CostModel &model) {
+    _model = model;
+    for (size_t i = 0; i < _commands.size(); i++)
+        _cost[i + 1] = _cost[i] + weight(i);
+}
+
+size_t Program::weight(const size_t i) const {
+    const Instruction &instruction = *_commands[i].instruction;
+    if (typeid(instruction) == typeid(MemInstruction) ||
+        typeid(instruction) == typeid(TaggedNopInstruction))
+        return 0;
+
+    return _model[_opcodes[i]];
+}
+
+inline void Program::charge(Environment &env,
+                            Charge &charge,
+                            int &entry,
+                            int end) const {
+    int size = _commands.size();
+    if (end > size)
+        end = size;
+    if (entry < end)
+        charge.spent += _cost[end] - _cost[entry];
+    entry = env.current;
+
+    if (charge.passed() > env.time_limit ||
+        env._group->stopped.load(memory_order_relaxed))
+        exceed(env, charge);
+}
+
+void Program::exceed(const Environment &env, const Charge &charge) const {
+    CHECK(charge.passed() <= env.time_limit,
+          TimeLimit,
+          "Time limit exceeded");
+    CHECK(false, TimeLimit, "Wall-clock limit exceeded");
+}
+
+template <bool preemptive, bool profiling>
+Program::Status Program::execute(Environment &env, const size_t budget) const {
+    size_t count = 0;
+    int position = env.current;
+    int entry = env.current;
+    Charge cost(env._group->timer);
+
+    try {
+        while (!env.exited()) {
+            if (!preemptive && count >= budget) {
+                charge(env, cost, entry, env.current);
+                return Exhausted;
+            }
+
+            position = env.current;
+            env._executing = position;
+            CHECK(position >= 0, InvalidPosition, "Invalid position");
+
+            const Command &comm = _commands[env.current];
+            bool block_end = _block_end[env.current];
+            env.current++;
+
+            if (typeid(*comm.instruction) == typeid(MemInstruction) ||
+                typeid(*comm.instruction) == typeid(TaggedNopInstruction))
+                continue;
+
+            cost.spent += comm.instruction->execute(&env, comm.args);
+
+            env.executed++;
+            count++;
+            if (profiling && env._wait == Environment::NoWait)
+                env.profile->record(_opcodes[position], position, env.current);
+            if (env.current != position + 1 && env._wait == Environment::NoWait)
+                charge(env, cost, entry, position + 1);
+            if (block_end) {
+                if (env._wait != Environment::NoWait) {
+                    // The instruction will be executed again and charged then
+                    env.executed--;
+                    charge(env, cost, entry, position);
+
+                    Environment::Wait wait = env._wait;
+                    env._wait = Environment::NoWait;
+                    return wait == Environment::JoinWait ? Joining : Blocked;
+                }
+
+                if (preemptive && count >= budget) {
+                    charge(env, cost, entry, env.current);
+                    return Exhausted;
+                }
+            }
+        }  // while
+
+        charge(env, cost, entry, env.current);
+    } catch (const Error &e) {
+        env.fail(e, position);
+        return Failed;
+    }
+
+    if (env.join())
+        return Exited;
+
+    env._wait = Environment::NoWait;
+    return Joining;
+}
+
+Program::Status Program::run_for(Environment &env, const size_t budget) const {
+    if (_threaded) {
+        env.fail(Error(Error::Unsupported, "SPAWN is not supported by run_for"),
+                 env.current);
+        return Failed;
+    }
+
+    if (env.profile)
+        return execute<false, true>(env, budget);
+    return execute<false, false>(env, budget);
+}
+
+Program::Status Program::run_slice(Environment &env,
+                                   const size_t quantum) const {
+    if (env.profile)
+        return execute<true, true>(env, quantum);
+    return execute<true, false>(env, quantum);
+}
+
+void Program::restart(Environment &env) const {
+    env._group->timer = 0;
+    env._group->stopped = false;
+    env._group->executed = 0;
+    // Threads left behind by a failed run are gone
+    env._group->threads = 1;
+    env._pending = 0;
+    env._parked = false;
+    env.executed = 0;
+    env._wait = Environment::NoWait;
+    env.error = Error();
+    env.current = 0;
+}
+
+void Program::run_partical(Environment &env) const {
+    restart(env);
+
+    for (env.current = 0; env.current < _commands.size(); env.current++) {
+        const Command &comm = _commands[env.current];
+
+        if (typeid(*comm.instruction) == typeid(MemInstruction) ||
+            typeid(*comm.instruction) == typeid(TaggedNopInstruction)) {
+            comm.instruction->execute(&env, comm.args);
+        }
+    }  // for
+
+    env.current = 0;
+}
+
+void Program::rewind(Environment &env) const {
+    restart(env);
+    env.memory.reset();
+}
+
+/////////////
+// SAMPLER //
+/////////////
+
+/**
+ * Statistical profiler driven by `SIGPROF`
+ * An interval timer interrupts the process every `1 / frequency` seconds of
+ * CPU time. The handler reads the command being executed by the environment
+ * running on the interrupted thread, published by `enter` once per run or
+ * slice, and appends it to a fixed buffer with one relaxed `fetch_add`. The
+ * interpreter loop only pays for storing its position.
+ */
+class Sampler {
+ public:
+    /**
+     * The maximum number of samples, later samples are dropped
+     */
+    constexpr static size_t Capacity = 1 << 22;
+
+    Sampler(const Program &program, const size_t frequency)
+            : _program(program),
+              _frequency(max<size_t>(frequency, 1)),
+              _samples(new int[Capacity]),
+              _count(0),
+              _idle(0) {}
+
+    Sampler(const Sampler &) = delete;
+    Sampler &operator=(const Sampler &) = delete;
+
+    ~Sampler() {
+        stop();
+    }
+
+    /**
+     * Install the handler and arm the timer, only one sampler can be active
+     */
+    void start() {
+        ASSERT(_active == nullptr, "Another sampler is running");
+        _active = this;
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &_previous_handler);
+
+        long period = max<long>(1000000 / _frequency, 1);
+        itimerval timer;
+        timer.it_interval.tv_sec = period / 1000000;
+        timer.it_interval.tv_usec = period % 1000000;
+        timer.it_value = timer.it_interval;
+        ASSERT(setitimer(ITIMER_PROF, &timer, nullptr) == 0,
+               "Cannot start the sampling timer");
+    }
+
+    /**
+     * Disarm the timer and restore the previous handler
+     */
+    void stop() {
+        if (_active != this)
+            return;
+
+        itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &_previous_handler, nullptr);
+        _active = nullptr;
+    }
+
+    /**
+     * Publish the environment running on the calling thread
+     * @param env Environment, NULL when the thread stops running one
+     */
+    static void enter(const Environment *env) {
+        _running = env;
+    }
+
+    /**
+     * Return the command being executed on the calling thread
+     * @return Index of the command, -1 if no program is running
+     * @remark Safe to call from signal handlers
+     */
+    static int position() {
+        const Environment *env = _running;
+        return env ? env->_executing : -1;
+    }
+
+    /**
+     * Number of samples taken while no program was running
+     */
+    size_t idle() const {
+        return _idle;
+    }
+
+    /**
+     * Convert the samples into a profile counting samples instead of
+     * executions
+     * @return Profile without branch and loop counters
+     */
+    Profile profile() const {
+        Profile result(_program);
+        result.exact = false;
+
+        size_t count = _count;
+        if (count > Capacity)
+            count = Capacity;
+        for (size_t i = 0; i < count; i++) {
+            int position = _samples[i];
+            result.opcodes[_program.opcode(position)]++;
+            result.commands[position]++;
+        }  // for
+
+        return result;
+    }
+
+ private:
+    static void on_signal(int) {
+        Sampler *sampler = _active;
+        const Environment *env = _running;
+
+        // Threads also run other programs, e.g. in batch mode
+        if (!sampler || !env || env->program != &sampler->_program) {
+            if (sampler)
+                sampler->_idle++;
+            return;
+        }
+
+        int position = env->_executing;
+        if (position < 0 || position >= static_cast<int>(env->program->size()))
+            return;
+
+        size_t index = sampler->_count.fetch_add(1, memory_order_relaxed);
+        if (index < Capacity)
+            sampler->_samples[index] = position;
+    }
+
+    static Sampler *volatile _active;
+    static thread_local const Environment *volatile _running;
+    static struct sigaction _previous_handler;
+
+    const Program &_program;
+    size_t _frequency;
+    unique_ptr<int[]> _samples;
+    atomic<size_t> _count;
+    atomic<size_t> _idle;
+};  // class Sampler
+
+Sampler *volatile Sampler::_active;
+thread_local const Environment *volatile Sampler::_running;
+struct sigaction Sampler::_previous_handler;
+
+//////////////
+// WATCHDOG //
+//////////////
+
+/**
+ * Thread stopping a program after a wall-clock timeout
+ * It only sets the stop flag of the environment, which running threads check
+ * at the end of every basic block, so the interpreter never reads the clock.
+ */
+class Watchdog {
+ public:
+    /**
+     * @param env     Environment to stop
+     * @param seconds Timeout
+     */
+    Watchdog(Environment &env, const double seconds) : _done(false) {
+        _thread = thread([this, &env, seconds]() {
+            unique_lock<mutex> guard(_lock);
+            if (!_wake.wait_for(guard,
+                                chrono::duration<double>(seconds),
+                                [this]() { return _done; }))
+                env.stop();
+        });
+    }
+
+    Watchdog(const Watchdog &) = delete;
+    Watchdog &operator=(const Watchdog &) = delete;
+
+    ~Watchdog() {
+        {
+            lock_guard<mutex> guard(_lock);
+            _done = true;
+        }
+
+        _wake.notify_all();
+        _thread.join();
+    }
+
+ private:
+    mutex _lock;
+    condition_variable _wake;
+    bool _done;
+    thread _thread;
+};  // class Watchdog
+
+/**
+ * Limits of every run in a mode
+ */
+struct Limits {
+    Limits() : time_limit(Program::Timelimit), timeout(0) {}
+
+    /**
+     * Apply the time limit and start a watchdog if there is a timeout
+     * @param  env Environment about to run
+     * @return     Watchdog stopping `env` after the timeout unless destroyed
+     * before, or NULL
+     */
+    unique_ptr<Watchdog> apply(Environment &env) const {
+        env.time_limit = time_limit;
+        if (timeout <= 0)
+            return nullptr;
+
+        return unique_ptr<Watchdog>(new Watchdog(env, timeout));
+    }
+
+    /**
+     * Maximum time under the cost model, SIZE_MAX for no limit
+     */
+    size_t time_limit;
+
+    /**
+     * Wall-clock timeout in seconds, 0 for none
+     */
+    double timeout;
+};  // struct Limits
+
+///////////////
+// SCHEDULER //
+///////////////
+
+/**
+ * M:N scheduler running `SPAWN` threads on a fixed pool of OS threads
+ * Every worker owns a deque of runnable environments. A worker pops from the
+ * back of its own deque and steals from the front of the others when it runs
+ * out of work. Threads are preempted at the end of a basic block once they
+ * have used up their quantum. Workers finding no work sleep until a thread
+ * becomes runnable or the program ends.
+ */
+class Scheduler {
+ public:
+    Scheduler(const size_t workers, const size_t quantum)
+            : _quantum(quantum > 0 ? quantum : 1),
+              _done(false),
+              _failed(false),
+              _root(nullptr),
+              _queued(0),
+              _sleeping(0) {
+        for (size_t i = 0; i < max<size_t>(workers, 1); i++)
+            _workers.emplace_back(new Worker);
+    }
+
+    /**
+     * Run `root` and all threads it starts on the calling thread and the pool
+     * @param  root Environment prepared by `run_partical`
+     * @return      `Exited`, or `Failed` with the first error in `root.error`
+     */
+    Program::Status run(Environment &root) {
+        _root = &root;
+        if (root.profile)
+            _profile.reset(new Profile(*root.program));
+        root._group->scheduler = this;
+        _workers[0]->tasks.push_back(&root);
+        _queued = 1;
+
+        vector<thread> threads;
+        for (size_t i = 1; i < _workers.size(); i++)
+            threads.emplace_back(&Scheduler::work, this, i);
+        work(0);
+
+        for (auto &t : threads)
+            t.join();
+        root._group->scheduler = nullptr;
+
+        // Threads abandoned by a failure
+        for (auto env : _live) {
+            root._group->executed += env->executed;
+            delete env;
+        }  // foreach in _live
+        if (_failed)
+            root.error.instructions = root.instruction_count();
+        if (_profile)
+            root.profile->merge(*_profile);
+
+        return _failed ? Program::Failed : Program::Exited;
+    }
+
+    /**
+     * Take ownership of a thread created by `SPAWN` and make it runnable
+     * @param env New environment
+     */
+    void adopt(Environment *env) {
+        {
+            lock_guard<mutex> guard(_live_lock);
+            _live.insert(env);
+        }
+
+        push(env);
+    }
+
+    /**
+     * Make `env` runnable on the current worker
+     * @param env  Environment
+     * @param back Whether to put it where the worker pops next
+     */
+    void push(Environment *env, const bool back = true) {
+        Worker &worker = *_workers[_self];
+        lock_guard<mutex> guard(worker.lock);
+
+        if (back)
+            worker.tasks.push_back(env);
+        else
+            worker.tasks.push_front(env);
+        _queued++;
+
+        if (_sleeping > 0)
+            wake();
+    }
+
+ private:
+    struct Worker {
+        mutex lock;
+        deque<Environment *> tasks;
+    };  // struct Worker
+
+    Environment *take() {
+        for (size_t i = 0; i < _workers.size(); i++) {
+            size_t victim = (_self + i) % _workers.size();
+            Worker &worker = *_workers[victim];
+            lock_guard<mutex> guard(worker.lock);
+
+            if (worker.tasks.empty())
+                continue;
+
+            Environment *env;
+            if (victim == _self) {
+                env = worker.tasks.back();
+                worker.tasks.pop_back();
+            } else {
+                env = worker.tasks.front();
+                worker.tasks.pop_front();
+            }
+
+            _queued--;
+            return env;
+        }  // for
+
+        return nullptr;
+    }
+
+    void work(const size_t id) {
+        _self = id;
+
+        while (!_done.load(memory_order_acquire)) {
+            Environment *env = take();
+            if (!env) {
+                sleep();
+                continue;
+            }
+
+            Sampler::enter(env);
+            Program::Status status = env->program->run_slice(*env, _quantum);
+            Sampler::enter(nullptr);
+
+            switch (status) {
+                case Program::Exited: finish(env); break;
+                case Program::Exhausted:
+                case Program::Blocked: push(env, false); break;
+                case Program::Joining: park(env); break;
+                case Program::Failed: fail(env); break;
+            }  // switch
+        }  // while
+    }
+
+    void finish(Environment *env) {
+        Environment *parent = env->_parent;
+
+        if (!parent) {
+            _done.store(true, memory_order_release);
+            wake(true);
+            return;
+        }
+
+        env->_group->executed += env->executed;
+        env->_group->threads--;
+        {
+            lock_guard<mutex> guard(_live_lock);
+            _live.erase(env);
+            if (_profile)
+                _profile->merge(*env->profile);
+        }
+        delete env;
+
+        if (parent->_pending.fetch_sub(1) == 1 &&
+            parent->_parked.exchange(false))
+            push(parent);
+    }
+
+    void fail(Environment *env) {
+        lock_guard<mutex> guard(_live_lock);
+
+        if (!_failed) {
+            _failed = true;
+            _root->error = env->error;
+        }
+
+        _done.store(true, memory_order_release);
+        wake(true);
+    }
+
+    /**
+     * Block the calling worker until a thread is runnable or the program ends
+     */
+    void sleep() {
+        unique_lock<mutex> guard(_idle_lock);
+        _sleeping++;
+        _idle_wake.wait(guard, [this]() {
+            return _queued > 0 || _done.load(memory_order_acquire);
+        });
+        _sleeping--;
+    }
+
+    /**
+     * Wake sleeping workers
+     * @param all Whether to wake all of them instead of one
+     */
+    void wake(const bool all = false) {
+        // Taking the lock orders the notification after the check in `sleep`
+        { lock_guard<mutex> guard(_idle_lock); }
+
+        if (all)
+            _idle_wake.notify_all();
+        else
+            _idle_wake.notify_one();
+    }
+
+    void park(Environment *env) {
+        env->_parked = true;
+
+        if (env->_pending == 0 && env->_parked.exchange(false))
+            push(env);
+    }
+
+    static thread_local size_t _self;
+
+    size_t _quantum;
+    atomic<bool> _done;
+    bool _failed;
+    Environment *_root;
+    vector<unique_ptr<Worker>> _workers;
+
+    /**
+     * Number of runnable threads in the deques and of workers in `sleep`
+     */
+    atomic<size_t> _queued;
+    atomic<size_t> _sleeping;
+    mutex _idle_lock;
+    condition_variable _idle_wake;
+
+    mutex _live_lock;
+    unordered_set<Environment *> _live;
+
+    /**
+     * Merged profiles of ended threads
+     */
+    unique_ptr<Profile> _profile;
+};  // class Scheduler
+
+thread_local size_t Scheduler::_self;
+
+Program::Status Program::run(Environment &env) const {
+    if (_threaded) {
+        Scheduler scheduler(env.workers, env.quantum);
+
+        return scheduler.run(env);
+    }
+
+    Sampler::enter(&env);
+    Status status =
+            env.profile ? run_serial<true>(env) : run_serial<false>(env);
+    Sampler::enter(nullptr);
+
+    return status;
+}
+
+template <bool profiling>
+Program::Status Program::run_serial(Environment &env) const {
+    int position = env.current;
+    int entry = env.current;
+    Charge cost(env._group->timer);
+
+    try {
+        while (!env.exited()) {
+            position = env.current;
+            env._executing = position;
+            CHECK(0 <= env.current && env.current < _commands.size(),
+                  InvalidPosition,
+                  "Invalid position");
+
+            const Command &comm = _commands[env.current];
+            env.current++;
+
+            if (typeid(*comm.instruction) == typeid(MemInstruction) ||
+                typeid(*comm.instruction) == typeid(TaggedNopInstruction))
+                continue;
+
+            ASSERT(comm.instruction != nullptr, "Invalid instruction");
+            ASSERT(comm.args != nullptr, "Arguments missing");
+            cost.spent += comm.instruction->execute(&env, comm.args);
+            env.executed++;
+            if (profiling)
+                env.profile->record(_opcodes[position], position, env.current);
+            if (env.current != position + 1)
+                charge(env, cost, entry, position + 1);
+        }  // while
+
+        charge(env, cost, entry, env.current);
+    } catch (const Error &e) {
+        env.fail(e, position);
+        return Failed;
+    }
+
+    return Exited;
+}
+
+void Environment::spawn(const int entry) {
+    ASSERT(_group->scheduler != nullptr, "(internal) No scheduler");
+    // Reserve the slot first, so concurrent SPAWNs cannot exceed the limit
+    if (_group->threads.fetch_add(1) >= MaxThreads) {
+        _group->threads--;
+        CHECK(false, ThreadLimit, "Too many threads");
+    }
+
+    _pending++;
+    _group->scheduler->adopt(new Environment(*this, entry));
+}
+
+bool Environment::join() {
+    if (_pending == 0)
+        return true;
+
+    _wait = JoinWait;
+    return false;
+}
+
+///////////
+// TOKEN //
+///////////
+
+struct Token {
+    constexpr static size_t MaxLexemeLength = 4096;
+
+    Token() : size(0), lexeme(nullptr) {}
+
+    Token(const char *buffer) : lexeme(nullptr) {
+        store(buffer);
+    }
+
+    Token(const char *buffer, const size_t beg, const size_t end)
+            : lexeme(nullptr) {
+        store(buffer, beg, end);
+    }
+
+    Token(const Token &b) {
+        store(b.lexeme);
+    }
+
+    Token(Token &&b) : size(b.size), lexeme(b.lexeme) {
+        b.size = 0;
+        b.lexeme = nullptr;
+    }
+
+    Token &operator=(const Token &b) {
+        this->store(b.lexeme);
+
+        return *this;
+    }
+
+    Token &operator=(Token &&b) {
+        size = b.size;
+        lexeme = b.lexeme;
+        b.size = 0;
+        b.lexeme = nullptr;
+
+        return *this;
+    }
+
+    ~Token() {
+        if (lexeme)
+            delete lexeme;
+    }
+
+    void store(const char *buffer,
+               const size_t beg = 0,
+               const size_t end = UINT_MAX) {
+        if (end < UINT_MAX)
+            size = end - beg;
+        else
+            size = strlen(buffer + beg);
+
+        CHECK(size <= MaxLexemeLength, Syntax, "Lexeme too loog");
+
+        if (lexeme)
+            delete lexeme;
+
+        lexeme = new char[size + 1];
+        memcpy(lexeme, buffer + beg, sizeof(char) * size);
+        lexeme[size] = '\0';
+    }
+
+    bool equal_to(const char *str) const {
+        return equal(str, str + strlen(str), lexeme, lexeme + size);
+    }
+
+    bool is_int() const {
+        return size > 0 && isdigit(lexeme[size - 1]);
+    }
+
+    int as_int() const {
+        return atoi(lexeme);
+    }
+
+    long as_long() const {
+        return atol(lexeme);
+    }
+
+    bool is_comment() const {
+        return size > 0 && lexeme[0] == '#';
+    }
+
+    long long as_long_long() const {
+        return atoll(lexeme);
+    }
+
+    size_t size;
+    char *lexeme;
+};  // struct Token
+
+///////////////
+// TOKENIZER //
+///////////////
+
+class Tokenizer {
+ public:
+    list<Token> tokenize(const char *buffer) const {
+        enum TokenType { UNKNOWN, ALPHAS, SIGNS, COMMENTS, DIGITS };
+
+        TokenType mode = UNKNOWN;
+        size_t lastpos = 0;
+        list<Token> tokens;
+        for (size_t pos = 0; buffer[pos]; pos++) {
+            char c = buffer[pos];
+
+            TokenType type;
+            if (isalpha(c))
+                type = ALPHAS;
+            else if (isdigit(c) || c == '-')
+                type = DIGITS;
+            else if (c == '*')
+                type = SIGNS;
+            else if (c == '#')
+                type = COMMENTS;
+            else if (isspace(c))
+                type = UNKNOWN;
+            else
+                CHECK(false, Syntax, "Unrecognized character")
+
+            if (type == UNKNOWN) {
+                if (mode != UNKNOWN) {
+                    mode = UNKNOWN;
+                    tokens.push_back(Token(buffer, lastpos, pos));
+                }
+            } else {
+                if (mode == UNKNOWN) {
+                    mode = type;
+                    lastpos = pos;
+                } else if (mode != type) {
+                    mode = UNKNOWN;
+                    tokens.push_back(Token(buffer, lastpos, pos));
+                    pos--;
+                }
+            }
+
+            if (type == COMMENTS)
+                break;
+        }  // for
+
+        return tokens;
+    }
+};  // class Tokenizer
+
+////////////
+// PARSER //
+////////////
+
+class Parser {
+ public:
+    constexpr static size_t MaxIntegerLength = 10;
+
+    typedef Program::Command Command;
+    typedef list<Token> TokenList;
+
+    template <typename TIterator>
+    void read_value(TIterator &beg, const TIterator end, Value &target) const {
+        int value;
+        size_t recur = 0;
+        while (true) {
+            CHECK(beg != end, Syntax, "Invalid value");
+
+            if (beg->is_int()) {
+                CHECK(beg->size <= MaxIntegerLength,
+                      Syntax,
+                      "Integer too long");
+
+                value = beg->as_int();
+                beg++;
+                break;
+            } else
+                recur += beg->size;
+
+            beg++;
+        }  // while
+
+        target.set(value, recur);
+    }
+
+    /**
+     * Allocate a command once its operands have been read
+     * `read_value` throws on syntax errors, so nothing is allocated before.
+     */
+    template <typename TInstruction>
+    static Command make(const typename TInstruction::ArgsType &args) {
+        return { new TInstruction, new typename TInstruction::ArgsType(args) };
+    }
+
+    Command parse_nop(const TokenList &tokens) const {
+        if (tokens.back().is_int()) {
+            TaggedNopInstruction::TaggedNopArgs args;
+            auto beg = std::next(tokens.begin());
+
+            read_value(beg, tokens.end(), args.index);
+
+            return make<TaggedNopInstruction>(args);
+        } else {
+            NopInstruction::NopArgs args;
+
+            return make<NopInstruction>(args);
+        }
+    }
+
+    template <typename TInstruction>
+    Command parse_i(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.index);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_v(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.value);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_vv(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.value1);
+        read_value(beg, tokens.end(), args.value2);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_vi(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.value);
+        read_value(beg, tokens.end(), args.index);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_vvi(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.value1);
+        read_value(beg, tokens.end(), args.value2);
+        read_value(beg, tokens.end(), args.index);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_none(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_ivi(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.cell);
+        read_value(beg, tokens.end(), args.value);
+        read_value(beg, tokens.end(), args.index);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_ivvi(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.cell);
+        read_value(beg, tokens.end(), args.value1);
+        read_value(beg, tokens.end(), args.value2);
+        read_value(beg, tokens.end(), args.index);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_iiv(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.source);
+        read_value(beg, tokens.end(), args.target);
+        read_value(beg, tokens.end(), args.length);
+
+        return make<TInstruction>(args);
+    }
+
+    template <typename TInstruction>
+    Command parse_iiiv(const TokenList &tokens) const {
+        typename TInstruction::ArgsType args;
+        auto beg = std::next(tokens.begin());
+
+        read_value(beg, tokens.end(), args.source1);
+        read_value(beg, tokens.end(), args.source2);
+        read_value(beg, tokens.end(), args.target);
+        read_value(beg, tokens.end(), args.length);
+
+        return make<TInstruction>(args);
+    }
+
+    Command parse(const char *line) const {
+        return parse(_tokenizer.tokenize(line));
+    }
+
+    Command parse(const TokenList &tokens) const {
+        if (tokens.empty() || tokens.front().is_comment())
+            return { new NopInstruction, new NopInstruction::NopArgs };
+
+        if (tokens.front().equal_to("NOP"))  // NOP and Tagger NOP
+            return parse_nop(tokens);
+        else if (tokens.front().equal_to("MEM"))
+            return parse_v<MemInstruction>(tokens);
+        else if (tokens.front().equal_to("IN"))
+            return parse_i<InInstruction>(tokens);
+        else if (tokens.front().equal_to("OUT"))
+            return parse_v<OutInstruction>(tokens);
+        else if (tokens.front().equal_to("SET"))
+            return parse_vi<SetInstruction>(tokens);
+        else if (tokens.front().equal_to("ADD"))
+            return parse_vvi<AddInstruction>(tokens);
+        else if (tokens.front().equal_to("SUB"))
+            return parse_vvi<SubInstruction>(tokens);
+        else if (tokens.front().equal_to("MUL"))
+            return parse_vvi<MulInstruction>(tokens);
+        else if (tokens.front().equal_to("DIV"))
+            return parse_vvi<DivInstruction>(tokens);
+        else if (tokens.front().equal_to("MOD"))
+            return parse_vvi<ModInstruction>(tokens);
+        else if (tokens.front().equal_to("INC"))
+            return parse_vi<IncInstruction>(tokens);
+        else if (tokens.front().equal_to("DEC"))
+            return parse_vi<DecInstruction>(tokens);
+        else if (tokens.front().equal_to("NEC"))
+            return parse_vi<NecInstruction>(tokens);
+        else if (tokens.front().equal_to("AND"))
+            return parse_vvi<AndInstruction>(tokens);
+        else if (tokens.front().equal_to("OR"))
+            return parse_vvi<OrInstruction>(tokens);
+        else if (tokens.front().equal_to("XOR"))
+            return parse_vvi<XorInstruction>(tokens);
+        else if (tokens.front().equal_to("FLIP"))
+            return parse_vi<FlipInstruction>(tokens);
+        else if (tokens.front().equal_to("NOT"))
+            return parse_vi<NotInstruction>(tokens);
+        else if (tokens.front().equal_to("SHL"))
+            return parse_vvi<ShlInstruction>(tokens);
+        else if (tokens.front().equal_to("SHR"))
+            return parse_vvi<ShrInstruction>(tokens);
+        else if (tokens.front().equal_to("ROL"))
+            return parse_vvi<RolInstruction>(tokens);
+        else if (tokens.front().equal_to("ROR"))
+            return parse_vvi<RorInstruction>(tokens);
+        else if (tokens.front().equal_to("EQU"))
+            return parse_vvi<EquInstruction>(tokens);
+        else if (tokens.front().equal_to("GTER"))
+            return parse_vvi<GterInstruction>(tokens);
+        else if (tokens.front().equal_to("LESS"))
+            return parse_vvi<LessInstruction>(tokens);
+        else if (tokens.front().equal_to("GEQ"))
+            return parse_vvi<GeqInstruction>(tokens);
+        else if (tokens.front().equal_to("LEQ"))
+            return parse_vvi<LeqInstruction>(tokens);
+        else if (tokens.front().equal_to("JMP"))
+            return parse_v<JmpInstruction>(tokens);
+        else if (tokens.front().equal_to("JMOV"))
+            return parse_v<JmovInstruction>(tokens);
+        else if (tokens.front().equal_to("JIF"))
+            return parse_vv<JifInstruction>(tokens);
+        else if (tokens.front().equal_to("JIFM"))
+            return parse_vv<JifmInstruction>(tokens);
+        else if (tokens.front().equal_to("VADD"))
+            return parse_iiiv<VaddInstruction>(tokens);
+        else if (tokens.front().equal_to("VSUB"))
+            return parse_iiiv<VsubInstruction>(tokens);
+        else if (tokens.front().equal_to("VMUL"))
+            return parse_iiiv<VmulInstruction>(tokens);
+        else if (tokens.front().equal_to("VCMP"))
+            return parse_iiiv<VcmpInstruction>(tokens);
+        else if (tokens.front().equal_to("VSUM"))
+            return parse_iiv<VsumInstruction>(tokens);
+        else if (tokens.front().equal_to("VMAX"))
+            return parse_iiv<VmaxInstruction>(tokens);
+        else if (tokens.front().equal_to("SPAWN"))
+            return parse_v<SpawnInstruction>(tokens);
+        else if (tokens.front().equal_to("JOIN"))
+            return parse_none<JoinInstruction>(tokens);
+        else if (tokens.front().equal_to("CAS"))
+            return parse_ivvi<CasInstruction>(tokens);
+        else if (tokens.front().equal_to("FADD"))
+            return parse_ivi<FaddInstruction>(tokens);
+        else if (tokens.front().equal_to("XCHG"))
+            return parse_ivi<XchgInstruction>(tokens);
+        else
+            CHECK(false, Syntax, "Unknown instruction");
+    }
+
+    /**
+     * Parse every line of a file into program
+     * @param in      Opened ASM file
+     * @param program Target program
+     * @remark Syntax errors are raised with the line number as position
+     */
+    void load(FILE *in, Program &program) const {
+        char buffer[2048];
+        int line = 0;
+
+        try {
+            for (; fgets(buffer, sizeof(buffer), in); line++) {
+                auto command = parse(buffer);
+
+                if (command.is_valid())
+                    program.append(command, line + 1);
+            }  // for
+        } catch (Error &e) {
+            e.position = line;
+            throw;
+        }
+    }
+
+    /**
+     * Parse lines tokenized before into program, like `load` for a file
+     * @param lines   Tokens of every line
+     * @param program Target program
+     */
+    void load(const vector<TokenList> &lines, Program &program) const {
+        size_t line = 0;
+
+        try {
+            for (; line < lines.size(); line++) {
+                auto command = parse(lines[line]);
+
+                if (command.is_valid())
+                    program.append(command, line + 1);
+            }  // for
+        } catch (Error &e) {
+            e.position = line;
+            throw;
+        }
+    }
+
+ private:
+    Tokenizer _tokenizer;
+};  // class Parser
+
+/**
+ * File closed when it goes out of scope, also when parsing it throws
+ */
+typedef unique_ptr<FILE, int (*)(FILE *)> FileGuard;
+
+//////////////////
+// BATCH RUNNER //
+//////////////////
+
+/**
+ * Run one loaded program against many input files in parallel
+ */
+class BatchRunner {
+ public:
+    /**
+     * Size of the output buffer owned by each worker
+     */
+    constexpr static size_t OutputBufferSize = 1 << 16;
+
+    BatchRunner(const Program &image,
+                const size_t workers,
+                const Limits &limits = Limits())
+            : _image(image),
+              _workers(workers > 0 ? workers : 1),
+              _limits(limits) {}
+
+    /**
+     * Run every regular file in `input_dir`
+     * @param  input_dir  Directory of input files
+     * @param  output_dir Directory of output files, `x.in` produces `x.out`
+     * and other names get an `.out` suffix
+     * @param  profile    Receives the counters of all cases if not NULL
+     * @return            Number of cases
+     * @remark A failed case gets the error as the last line of its output and
+     * is reported to stderr, the other cases are not affected
+     */
+    size_t run(const char *input_dir,
+               const char *output_dir,
+               Profile *profile = nullptr) {
+        _profile = profile;
+        _input_dir = input_dir;
+        _output_dir = output_dir;
+        _cases = list_cases(input_dir);
+        _next = 0;
+        _failures = 0;
+
+        vector<thread> threads;
+        size_t count = min(_workers, _cases.size());
+        for (size_t i = 0; i < count; i++)
+            threads.emplace_back(&BatchRunner::work, this);
+        for (auto &t : threads)
+            t.join();
+
+        return _cases.size();
+    }
+
+    /**
+     * Number of failed cases in the last `run`
+     */
+    size_t failures() const {
+        return _failures;
+    }
+
+ private:
+    static vector<string> list_cases(const char *input_dir) {
+        DIR *dir = opendir(input_dir);
+        ASSERT(dir != nullptr, "Cannot open input directory");
+
+        vector<string> cases;
+        while (auto entry = readdir(dir)) {
+            if (entry->d_name[0] == '.')
+                continue;
+
+            string path = string(input_dir) + "/" + entry->d_name;
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+                cases.push_back(entry->d_name);
+        }  // while
+
+        closedir(dir);
+        sort(cases.begin(), cases.end());
+
+        return cases;
+    }
+
+    static string output_name(const string &name) {
+        const string suffix = ".in";
+
+        if (name.size() > suffix.size() &&
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) ==
+                    0)
+            return name.substr(0, name.size() - suffix.size()) + ".out";
+        return name + ".out";
+    }
+
+    void work() {
+        Environment env(_image);
+        vector<char> buffer(OutputBufferSize);
+
+        unique_ptr<Profile> profile;
+        if (_profile) {
+            profile.reset(new Profile(_image));
+            env.profile = profile.get();
+        }
+
+        for (size_t i = _next++; i < _cases.size(); i = _next++) {
+            string in_path = _input_dir + "/" + _cases[i];
+            string out_path = _output_dir + "/" + output_name(_cases[i]);
+
+            FILE *in = fopen(in_path.c_str(), "r");
+            FILE *out = fopen(out_path.c_str(), "w");
+            if (!in || !out) {
+                fprintf(stderr,
+                        "%s: (ERROR) Cannot open file\n",
+                        _cases[i].c_str());
+                _failures++;
+
+                if (in)
+                    fclose(in);
+                if (out)
+                    fclose(out);
+                continue;
+            }
+
+            setvbuf(out, buffer.data(), _IOFBF, buffer.size());
+
+            env.open(in, out);
+            env.workers = 1;
+            try {
+                if (env.memory.has_snapshot())
+                    _image.rewind(env);
+                else {
+                    _image.run_partical(env);
+                    env.memory.snapshot();
+                }
+
+                auto watchdog = _limits.apply(env);
+                if (_image.run(env) == Program::Failed)
+                    throw env.error;
+            } catch (const Error &e) {
+                e.print(out);
+                fprintf(stderr, "%s: ", _cases[i].c_str());
+                e.print(stderr);
+                _failures++;
+            }
+
+            fclose(in);
+            fclose(out);
+        }  // for
+
+        if (profile) {
+            lock_guard<mutex> guard(_profile_lock);
+            _profile->merge(*profile);
+        }
+    }
+
+    const Program &_image;
+    size_t _workers;
+    Limits _limits;
+    string _input_dir;
+    string _output_dir;
+    vector<string> _cases;
+    atomic<size_t> _next;
+    atomic<size_t> _failures;
+    Profile *_profile;
+    mutex _profile_lock;
+};  // class BatchRunner
+
+////////////
+// SERVER //
+////////////
+
+/**
+ * Wire format of the server
+ * A client sends `JobHeader`, the program text and the input text, and
+ * receives `ResultHeader` followed by the output text. A connection may carry
+ * any number of jobs.
+ */
+struct JobHeader {
+    uint32_t program_size;
+    uint32_t input_size;
+};  // struct JobHeader
+
+struct ResultHeader {
+    int32_t status;
+    uint32_t output_size;
+    uint64_t instructions;
+    uint64_t passed_time;
+    uint64_t wall_time;  // In nanoseconds
+};  // struct ResultHeader
+
+/**
+ * Read exactly `size` bytes
+ * @return false on EOF or error
+ */
+bool read_all(int fd, void *buffer, size_t size) {
+    char *p = reinterpret_cast<char *>(buffer);
+
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }  // while
+
+    return true;
+}
+
+/**
+ * Write exactly `size` bytes
+ * @return false on error, including `EPIPE` when the peer has gone
+ */
+bool write_all(int fd, const void *buffer, size_t size) {
+    const char *p = reinterpret_cast<const char *>(buffer);
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }  // while
+
+    return true;
+}
+
+/**
+ * Long-lived server executing jobs received on a Unix domain socket
+ * Parsed programs are cached by the hash of their text, so repeated jobs only
+ * pay for memory initialization and execution.
+ */
+class Server {
+ public:
+    /**
+     * The maximum size of program or input text in one job
+     */
+    constexpr static size_t MaxJobSize = 1 << 28;
+
+    /**
+     * The maximum number of cached programs
+     */
+    constexpr static size_t MaxCachedPrograms = 1024;
+
+    /**
+     * @param workers Number of connections served at once
+     * @param limits  Limits of every job
+     * @param costs   Cost model of the programs
+     */
+    Server(const size_t workers,
+           const Limits &limits = Limits(),
+           const CostModel &costs = CostModel())
+            : _workers(workers > 0 ? workers : 1),
+              _limits(limits),
+              _costs(costs) {}
+
+    /**
+     * Accept connections on `path` forever
+     * @param path Socket path, removed first if it exists
+     */
+    void listen(const char *path) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT(fd >= 0, "Cannot create socket");
+
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        ASSERT(strlen(path) < sizeof(address.sun_path), "Socket path too long");
+        strcpy(address.sun_path, path);
+
+        // A client leaving before its reply must only drop its connection
+        signal(SIGPIPE, SIG_IGN);
+
+        unlink(path);
+        ASSERT(::bind(fd, reinterpret_cast<sockaddr *>(&address),
+                      sizeof(address)) == 0,
+               "Cannot bind socket");
+        ASSERT(::listen(fd, SOMAXCONN) == 0, "Cannot listen on socket");
+
+        vector<thread> threads;
+        for (size_t i = 0; i < _workers; i++)
+            threads.emplace_back(&Server::work, this);
+
+        while (true) {
+            int client = accept(fd, nullptr, nullptr);
+            if (client < 0)
+                continue;
+
+            lock_guard<mutex> guard(_queue_lock);
+            _connections.push_back(client);
+            _ready.notify_one();
+        }  // while
+    }
+
+ private:
+    /**
+     * 64-bit FNV-1a
+     */
+    static uint64_t hash(const string &text) {
+        uint64_t result = 14695981039346656037ULL;
+
+        for (char c : text) {
+            result ^= static_cast<unsigned char>(c);
+            result *= 1099511628211ULL;
+        }  // foreach in text
+
+        return result;
+    }
+
+    shared_ptr<const Program> compile(const string &source) {
+        uint64_t key = hash(source);
+
+        {
+            lock_guard<mutex> guard(_cache_lock);
+            auto iter = _cache.find(key);
+            if (iter != _cache.end() && iter->second.source == source)
+                return iter->second.program;
+        }
+
+        shared_ptr<Program> program(new Program);
+        if (!source.empty()) {
+            FileGuard in(fmemopen(const_cast<char *>(source.data()),
+                                  source.size(),
+                                  "r"),
+                         fclose);
+            ASSERT(in != nullptr, "(internal) Cannot open program text");
+            Parser().load(in.get(), *program);
+        }
+        program->set_costs(_costs);
+
+        lock_guard<mutex> guard(_cache_lock);
+        if (_cache.size() >= MaxCachedPrograms)
+            _cache.clear();
+        _cache[key] = { source, program };
+
+        return program;
+    }
+
+    bool serve_job(int fd) {
+        JobHeader header;
+        if (!read_all(fd, &header, sizeof(header)) ||
+            header.program_size > MaxJobSize || header.input_size > MaxJobSize)
+            return false;
+
+        string source(header.program_size, '\0');
+        string input(header.input_size, '\0');
+        if (!read_all(fd, &source[0], source.size()) ||
+            !read_all(fd, &input[0], input.size()))
+            return false;
+
+        auto start = chrono::steady_clock::now();
+        ResultHeader result;
+        result.status = Error::None;
+        result.instructions = 0;
+        result.passed_time = 0;
+
+        char *output = nullptr;
+        size_t output_size = 0;
+        // `fmemopen` rejects empty buffers, an empty input reads one '\0'
+        FILE *in = fmemopen(&input[0], max<size_t>(input.size(), 1), "r");
+        FILE *out = open_memstream(&output, &output_size);
+        if (!in || !out) {
+            if (in)
+                fclose(in);
+            if (out)
+                fclose(out);
+            free(output);
+            return false;
+        }
+
+        // Errors of the job are reported to the client, not the server
+        try {
+            auto program = compile(source);
+
+            Environment env(*program);
+            env.open(in, out);
+            env.workers = 1;
+            program->run_partical(env);
+            auto watchdog = _limits.apply(env);
+            if (program->run(env) == Program::Failed) {
+                result.status = env.error.kind;
+                env.error.print(out);
+            }
+
+            result.instructions = env.instruction_count();
+            result.passed_time = env.passed_time();
+        } catch (const Error &e) {
+            result.status = e.kind;
+            e.print(out);
+        }
+
+        fclose(in);
+        fclose(out);
+
+        result.output_size = output_size;
+        result.wall_time = chrono::duration_cast<chrono::nanoseconds>(
+                                   chrono::steady_clock::now() - start)
+                                   .count();
+
+        bool ok = write_all(fd, &result, sizeof(result)) &&
+                  write_all(fd, output, output_size);
+        free(output);
+
+        return ok;
+    }
+
+    void work() {
+        while (true) {
+            int fd;
+
+            {
+                unique_lock<mutex> guard(_queue_lock);
+                _ready.wait(guard, [this]() { return !_connections.empty(); });
+                fd = _connections.front();
+                _connections.pop_front();
+            }
+
+            while (serve_job(fd)) {
+            }  // while
+
+            close(fd);
+        }  // while
+    }
+
+    struct CachedProgram {
+        string source;
+        shared_ptr<const Program> program;
+    };  // struct CachedProgram
+
+    size_t _workers;
+    Limits _limits;
+    CostModel _costs;
+    mutex _cache_lock;
+    unordered_map<uint64_t, CachedProgram> _cache;
+    mutex _queue_lock;
+    condition_variable _ready;
+    deque<int> _connections;
+};  // class Server
+
+/**
+ * Submit one job to a server and print its output
+ * @param  path   Socket path
+ * @param  source Program text
+ * @param  input  Input text
+ * @return        Status of the job
+ */
+int submit(const char *path, const string &source, const string &input) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT(fd >= 0, "Cannot create socket");
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    ASSERT(strlen(path) < sizeof(address.sun_path), "Socket path too long");
+    strcpy(address.sun_path, path);
+    ASSERT(connect(fd, reinterpret_cast<sockaddr *>(&address),
+                   sizeof(address)) == 0,
+           "Cannot connect to server");
+
+    JobHeader header;
+    header.program_size = source.size();
+    header.input_size = input.size();
+    ASSERT(write_all(fd, &header, sizeof(header)) &&
+                   write_all(fd, source.data(), source.size()) &&
+                   write_all(fd, input.data(), input.size()),
+           "Cannot send job");
+
+    ResultHeader result;
+    ASSERT(read_all(fd, &result, sizeof(result)), "Cannot receive result");
+    string output(result.output_size, '\0');
+    ASSERT(read_all(fd, &output[0], output.size()), "Cannot receive output");
+    close(fd);
+
+    fwrite(output.data(), 1, output.size(), stdout);
+    fprintf(stderr,
+            "status %d, %llu instructions, time %llu, %.3f us\n",
+            result.status,
+            static_cast<unsigned long long>(result.instructions),
+            static_cast<unsigned long long>(result.passed_time),
+            result.wall_time / 1000.0);
+
+    return result.status;
+}
+
+/////////////
+// REACTOR //
+/////////////
+
+/**
+ * Host of many interactive programs on one thread
+ * Every session reads its input from a file descriptor. A session whose `IN`
+ * finds no input is suspended and resumed once `poll` reports more data, so
+ * slow or idle inputs never block the other sessions.
+ */
+class Reactor {
+ public:
+    /**
+     * Number of instructions a session runs before the next one is resumed
+     */
+    constexpr static size_t Quantum = 10000;
+
+    Reactor(const Limits &limits = Limits()) : _limits(limits) {}
+
+    /**
+     * Add a session
+     * @param program Loaded program
+     * @param in      Input file descriptor
+     * @param out     Output file descriptor
+     */
+    void add(const Program &program, const int in, const int out) {
+        _sessions.emplace_back(new Session(program, in, out));
+
+        Session &session = *_sessions.back();
+        session.env.input = &session.input;
+        session.env.output = &session.output;
+        session.env.time_limit = _limits.time_limit;
+        session.deadline = chrono::steady_clock::now() +
+                           chrono::duration_cast<chrono::nanoseconds>(
+                                   chrono::duration<double>(_limits.timeout));
+        program.run_partical(session.env);
+    }
+
+    /**
+     * Run until every session ended
+     */
+    void run() {
+        size_t alive = _sessions.size();
+
+        while (alive > 0) {
+            bool runnable = false;
+
+            for (auto &ptr : _sessions) {
+                Session &session = *ptr;
+                // Sessions run on this thread, so the timeout is checked
+                // here instead of by a `Watchdog`
+                if (!session.done && expired(session)) {
+                    session.env.stop();
+                    session.waiting = false;
+                }
+                if (session.done || session.waiting)
+                    continue;
+
+                switch (session.env.program->run_for(session.env, Quantum)) {
+                    case Program::Exhausted: runnable = true; break;
+                    case Program::Blocked:
+                    case Program::Joining: session.waiting = true; break;
+                    case Program::Exited: session.done = true; break;
+                    case Program::Failed:
+                        session.env.error.print(stderr);
+                        session.done = true;
+                        break;
+                }  // switch
+
+                write_all(session.out,
+                          session.output.text.data(),
+                          session.output.text.size());
+                session.output.text.clear();
+
+                if (session.done)
+                    alive--;
+            }  // foreach in _sessions
+
+            if (alive > 0)
+                wait(runnable ? 0 : next_deadline());
+        }  // while
+    }
+
+ private:
+    struct Session {
+        Session(const Program &program, const int in, const int out)
+                : env(program),
+                  in(in),
+                  out(out),
+                  eof(false),
+                  waiting(false),
+                  done(false) {}
+
+        Environment env;
+        BufferInput input;
+        TextOutput output;
+        int in;
+        int out;
+        bool eof;
+        bool waiting;
+        bool done;
+        chrono::steady_clock::time_point deadline;
+    };  // struct Session
+
+    bool expired(const Session &session) const {
+        return _limits.timeout > 0 &&
+               chrono::steady_clock::now() >= session.deadline;
+    }
+
+    /**
+     * Milliseconds until the first session times out, -1 for infinity
+     */
+    int next_deadline() const {
+        if (_limits.timeout <= 0)
+            return -1;
+
+        auto first = chrono::steady_clock::time_point::max();
+        for (auto &ptr : _sessions) {
+            if (!ptr->done)
+                first = min(first, ptr->deadline);
+        }  // foreach in _sessions
+
+        auto left = chrono::duration_cast<chrono::milliseconds>(
+                first - chrono::steady_clock::now());
+        return max<int>(left.count() + 1, 0);
+    }
+
+    /**
+     * Feed sessions with available input
+     * @param timeout Timeout of `poll` in milliseconds, -1 for infinity
+     */
+    void wait(const int timeout) {
+        vector<pollfd> fds;
+        vector<Session *> owners;
+        for (auto &ptr : _sessions) {
+            if (ptr->done || ptr->eof)
+                continue;
+
+            fds.push_back({ ptr->in, POLLIN, 0 });
+            owners.push_back(ptr.get());
+        }  // foreach in _sessions
+
+        if (!fds.empty() && poll(fds.data(), fds.size(), timeout) < 0)
+            return;
+
+        char buffer[4096];
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!fds[i].revents)
+                continue;
+
+            Session &session = *owners[i];
+            ssize_t n = read(session.in, buffer, sizeof(buffer));
+            if (n > 0)
+                session.input.feed(buffer, n);
+            else {
+                session.input.close();
+                session.eof = true;
+            }
+
+            session.waiting = false;
+        }  // for
+    }
+
+    Limits _limits;
+    vector<unique_ptr<Session>> _sessions;
+};  // class Reactor
+
+//////////////
+// PIPELINE //
+//////////////
+
+/**
+ * Programs running on separate threads, each `OUT` of a stage feeding `IN` of
+ * the next stage through a `RingBuffer`
+ * A stage whose `IN` finds its ring empty or whose `OUT` finds it full sleeps
+ * until the stage on the other side changes the ring, so a slow stage
+ * throttles the stages before it.
+ */
+class Pipeline {
+ public:
+    /**
+     * Number of instructions a stage runs between checks for blocking
+     */
+    constexpr static size_t Quantum = 10000;
+
+    Pipeline(const Limits &limits = Limits()) : _limits(limits) {}
+
+    /**
+     * Append a stage
+     * @param program Loaded program
+     */
+    void append(const Program &program) {
+        _stages.emplace_back(new Environment(program));
+    }
+
+    /**
+     * Run all stages until they exited
+     * A failed stage reports its error to stderr and closes its rings, so the
+     * stages around it see the end of input or discard their output.
+     * @param  in  Input of the first stage
+     * @param  out Output of the last stage
+     * @return     Whether no stage failed
+     */
+    bool run(FILE *in, FILE *out) {
+        size_t n = _stages.size();
+        _failed.assign(n, false);
+        _rings.clear();
+        for (size_t i = 0; i + 1 < n; i++)
+            _rings.emplace_back(new RingBuffer);
+
+        vector<unique_ptr<RingInput>> inputs;
+        vector<unique_ptr<RingOutput>> outputs;
+        for (size_t i = 0; i < n; i++) {
+            Environment &env = *_stages[i];
+            env.open(in, out);
+
+            if (i > 0) {
+                inputs.emplace_back(new RingInput(_rings[i - 1].get()));
+                env.input = inputs.back().get();
+            }
+            if (i + 1 < n) {
+                outputs.emplace_back(new RingOutput(_rings[i].get()));
+                env.output = outputs.back().get();
+            }
+
+            env.program->run_partical(env);
+        }  // for
+
+        vector<thread> threads;
+        for (size_t i = 0; i < n; i++)
+            threads.emplace_back(&Pipeline::work, this, i);
+        for (auto &t : threads)
+            t.join();
+
+        return find(_failed.begin(), _failed.end(), true) == _failed.end();
+    }
+
+ private:
+    void work(const size_t i) {
+        Environment &env = *_stages[i];
+        // A stage asleep on a ring is woken when its stopped peer fails and
+        // closes the ring
+        auto watchdog = _limits.apply(env);
+
+        while (true) {
+            Program::Status status = env.program->run_for(env, Quantum);
+
+            if (status == Program::Exited)
+                break;
+            if (status == Program::Failed) {
+                fprintf(stderr, "stage %zu: ", i);
+                env.error.print(stderr);
+                _failed[i] = true;
+                break;
+            }
+            if (status != Program::Blocked)
+                continue;
+
+            // Only rings block, the first input and last output are files
+            if (env.program->opcode(env.current) == Instruction::IN)
+                _rings[i - 1]->wait_readable();
+            else
+                _rings[i]->wait_writable();
+        }  // while
+
+        if (i > 0)
+            _rings[i - 1]->close_reader();
+        if (i < _rings.size())
+            _rings[i]->close_writer();
+    }
+
+    Limits _limits;
+    vector<unique_ptr<Environment>> _stages;
+    vector<unique_ptr<RingBuffer>> _rings;
+    vector<char> _failed;  // Not `vector<bool>`, written by different threads
+};  // class Pipeline
+
+/////////////////
+// FORK SERVER //
+/////////////////
+
+/**
+ * Run isolated copies of one prepared environment in child processes
+ * The program is parsed and its memory is initialized once; every run forks a
+ * copy-on-write child from that image, so it starts in the time of a `fork`.
+ */
+class ForkServer {
+ public:
+    ForkServer(const Program &program,
+               const size_t workers,
+               const Limits &limits = Limits())
+            : _program(program),
+              _env(program),
+              _workers(workers > 0 ? workers : 1),
+              _limits(limits) {
+        _program.run_partical(_env);
+    }
+
+    /**
+     * Serve requests until EOF
+     * Every line of `requests` is `input_path output_path`. For each finished
+     * run, `input_path status` is written to `report`, where status is the
+     * exit code, or `signal N` if the child was killed.
+     * @param requests Request stream
+     * @param report   Report stream
+     */
+    void serve(FILE *requests, FILE *report) {
+        char line[8192];
+
+        while (fgets(line, sizeof(line), requests)) {
+            string input, output;
+            if (!split(line, input, output))
+                continue;
+
+            while (_running.size() >= _workers)
+                reap(report);
+
+            fflush(nullptr);
+            pid_t pid = fork();
+            ASSERT(pid >= 0, "Cannot fork");
+
+            if (pid == 0)
+                run_child(input, output);
+            _running.push_back({ pid, input });
+        }  // while
+
+        while (!_running.empty())
+            reap(report);
+    }
+
+ private:
+    struct Child {
+        pid_t pid;
+        string input;
+    };  // struct Child
+
+    static bool split(const char *line, string &input, string &output) {
+        vector<char> a(strlen(line) + 1), b(strlen(line) + 1);
+        if (sscanf(line, "%s %s", a.data(), b.data()) != 2)
+            return false;
+
+        input = a.data();
+        output = b.data();
+
+        return true;
+    }
+
+    void run_child(const string &input, const string &output) {
+        FILE *in = fopen(input.c_str(), "r");
+        int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (!in || fd < 0)
+            _exit(-1);
+
+        // Errors are reported in the output file rather than the report
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+
+        // Threads do not survive `fork`, so the watchdog starts here
+        _env.open(in, stdout);
+        auto watchdog = _limits.apply(_env);
+        Program::Status status = _program.run(_env);
+        if (status == Program::Failed)
+            _env.error.print(stdout);
+        fflush(stdout);
+
+        _exit(status == Program::Failed ? -1 : 0);
+    }
+
+    void reap(FILE *report) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            return;
+
+        auto iter = find_if(_running.begin(),
+                            _running.end(),
+                            [pid](const Child &c) { return c.pid == pid; });
+        if (iter == _running.end())
+            return;
+
+        if (WIFSIGNALED(status))
+            fprintf(report,
+                    "%s signal %d\n",
+                    iter->input.c_str(),
+                    WTERMSIG(status));
+        else
+            fprintf(report,
+                    "%s %d\n",
+                    iter->input.c_str(),
+                    WEXITSTATUS(status));
+        fflush(report);
+
+        _running.erase(iter);
+    }
+
+    const Program &_program;
+    Environment _env;
+    size_t _workers;
+    Limits _limits;
+    list<Child> _running;
+};  // class ForkServer
+
+//////////////
+// PERF MAP //
+//////////////
+
+/**
+ * Native code regions naming basic blocks for Linux `perf`
+ * Every basic block gets a small generated trampoline that calls back into the
+ * interpreter to run the block, so samples taken while the block executes have
+ * the trampoline on their call stack. The regions are published in
+ * `/tmp/perf-<pid>.map` and as `JIT_CODE_LOAD` records of a jitdump file
+ * `/tmp/jit-<pid>.dump`, named after the source lines of the block.
+ */
+class PerfMap {
+ public:
+    /**
+     * Bytes reserved for each trampoline
+     */
+    constexpr static size_t TrampolineSize = 16;
+
+    /**
+     * Code of a trampoline `void (void *arg, void (*callback)(void *))`:
+     * `push rbp; mov rbp, rsp; call rsi; pop rbp; ret`, keeping the frame
+     * pointer chain intact for `perf record -g`
+     */
+    constexpr static unsigned char Code[] = { 0x55, 0x48, 0x89, 0xE5,
+                                              0xFF, 0xD6, 0x5D, 0xC3 };
+
+    /**
+     * Generate trampolines and publish them
+     * @param program Loaded program without `SPAWN`
+     * @param name    Name of the program used in region names
+     */
+    PerfMap(const Program &program, const char *name)
+            : _program(program), _code(nullptr), _code_size(0), _dump(nullptr) {
+#if defined(__x86_64__)
+        CHECK(!program.threaded(),
+              Unsupported,
+              "SPAWN is not supported by --perf");
+
+        // Blocks start at the first command and after every jump
+        for (size_t i = 0; i < program.size(); i++) {
+            if (i == 0 || program.ends_block(i - 1))
+                _starts.push_back(i);
+            _blocks.push_back(_starts.size() - 1);
+        }  // for
+
+        _code_size = max<size_t>(_starts.size() * TrampolineSize, 1);
+        void *p = mmap(nullptr,
+                       _code_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+        ASSERT(p != MAP_FAILED, "Cannot allocate trampolines");
+        _code = reinterpret_cast<unsigned char *>(p);
+        for (size_t i = 0; i < _starts.size(); i++)
+            memcpy(_code + i * TrampolineSize, Code, sizeof(Code));
+        ASSERT(mprotect(_code, _code_size, PROT_READ | PROT_EXEC) == 0,
+               "Cannot protect trampolines");
+
+        write_map(name);
+        write_dump(name);
+#else
+        (void) name;
+        CHECK(false, Unsupported, "--perf is only supported on x86-64");
+#endif
+    }
+
+    PerfMap(const PerfMap &) = delete;
+    PerfMap &operator=(const PerfMap &) = delete;
+
+    ~PerfMap() {
+        if (_dump) {
+            RecordHeader close = { JitCodeClose, sizeof(RecordHeader), now() };
+            fwrite(&close, sizeof(close), 1, _dump);
+            fclose(_dump);
+        }
+
+        if (_code)
+            munmap(_code, _code_size);
+    }
+
+    /**
+     * Run the program block by block through the trampolines
+     * @param  env Execution state prepared by `run_partical`
+     * @return     `Exited`, or `Failed` with the error in `env.error`
+     */
+    Program::Status run(Environment &env) {
+        Call call = { &_program, &env, Program::Exhausted };
+
+        Sampler::enter(&env);
+        while (call.status != Program::Exited &&
+               call.status != Program::Failed) {
+            // Jumps may land inside a block, it is still named by its start
+            int position = env.current;
+            size_t block =
+                    0 <= position && position < static_cast<int>(_blocks.size())
+                            ? _blocks[position]
+                            : 0;
+
+            typedef void (*Trampoline)(void *, void (*)(void *));
+            auto trampoline = reinterpret_cast<Trampoline>(
+                    _code + block * TrampolineSize);
+            trampoline(&call, run_block);
+        }  // while
+        Sampler::enter(nullptr);
+
+        return call.status;
+    }
+
+ private:
+    /**
+     * Record types and layout of the jitdump format
+     */
+    enum RecordType { JitCodeLoad = 0, JitCodeClose = 3 };
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t total_size;
+        uint32_t elf_mach;
+        uint32_t pad1;
+        uint32_t pid;
+        uint64_t timestamp;
+        uint64_t flags;
+    };  // struct FileHeader
+
+    struct RecordHeader {
+        uint32_t id;
+        uint32_t total_size;
+        uint64_t timestamp;
+    };  // struct RecordHeader
+
+    struct CodeLoad {
+        uint32_t pid;
+        uint32_t tid;
+        uint64_t vma;
+        uint64_t code_addr;
+        uint64_t code_size;
+        uint64_t code_index;
+    };  // struct CodeLoad
+
+    struct Call {
+        const Program *program;
+        Environment *env;
+        Program::Status status;
+    };  // struct Call
+
+    static void run_block(void *arg) {
+        Call *call = reinterpret_cast<Call *>(arg);
+        call->status = call->program->run_slice(*call->env, 1);
+    }
+
+    /**
+     * `CLOCK_MONOTONIC` in nanoseconds, the clock of `perf record -k 1`
+     */
+    static uint64_t now() {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+
+        return t.tv_sec * 1000000000ULL + t.tv_nsec;
+    }
+
+    string region_name(const char *name, const size_t block) const {
+        size_t first = _starts[block];
+        size_t last = block + 1 < _starts.size() ? _starts[block + 1] - 1
+                                                 : _program.size() - 1;
+
+        char buffer[64];
+        snprintf(buffer,
+                 sizeof(buffer),
+                 ":%d-%d",
+                 _program.line(first),
+                 _program.line(last));
+
+        return string("miniasm:") + name + buffer;
+    }
+
+    void write_map(const char *name) const {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        FILE *out = fopen(path, "w");
+        ASSERT(out != nullptr, "Cannot create perf map");
+
+        for (size_t i = 0; i < _starts.size(); i++) {
+            fprintf(out,
+                    "%llx %zx %s\n",
+                    static_cast<unsigned long long>(
+                            reinterpret_cast<uintptr_t>(_code) +
+                            i * TrampolineSize),
+                    sizeof(Code),
+                    region_name(name, i).c_str());
+        }  // for
+
+        fclose(out);
+    }
+
+    void write_dump(const char *name) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+        _dump = fopen(path, "w+");
+        ASSERT(_dump != nullptr, "Cannot create jitdump");
+
+        // `perf inject --jit` finds the dump through this executable mapping
+        void *marker = mmap(nullptr,
+                            sysconf(_SC_PAGESIZE),
+                            PROT_READ | PROT_EXEC,
+                            MAP_PRIVATE,
+                            fileno(_dump),
+                            0);
+        // E.g. on a noexec /tmp, the perf map alone still names the blocks
+        if (marker == MAP_FAILED) {
+            fprintf(stderr,
+                    "(WARNING) Cannot map %s, jitdump not written\n",
+                    path);
+            fclose(_dump);
+            unlink(path);
+            _dump = nullptr;
+            return;
+        }
+
+        FileHeader header;
+        header.magic = 0x4A695444;
+        header.version = 1;
+        header.total_size = sizeof(header);
+        header.elf_mach = 62;  // EM_X86_64
+        header.pad1 = 0;
+        header.pid = getpid();
+        header.timestamp = now();
+        header.flags = 0;
+        fwrite(&header, sizeof(header), 1, _dump);
+
+        for (size_t i = 0; i < _starts.size(); i++) {
+            string region = region_name(name, i);
+            uint64_t address = reinterpret_cast<uintptr_t>(_code) +
+                               i * TrampolineSize;
+
+            RecordHeader record;
+            record.id = JitCodeLoad;
+            record.total_size = sizeof(record) + sizeof(CodeLoad) +
+                                region.size() + 1 + sizeof(Code);
+            record.timestamp = now();
+
+            CodeLoad load;
+            load.pid = getpid();
+            load.tid = syscall(SYS_gettid);
+            load.vma = address;
+            load.code_addr = address;
+            load.code_size = sizeof(Code);
+            load.code_index = i;
+
+            fwrite(&record, sizeof(record), 1, _dump);
+            fwrite(&load, sizeof(load), 1, _dump);
+            fwrite(region.c_str(), region.size() + 1, 1, _dump);
+            fwrite(Code, sizeof(Code), 1, _dump);
+        }  // for
+
+        fflush(_dump);
+    }
+
+    const Program &_program;
+    vector<size_t> _starts;  // First command of each block
+    vector<size_t> _blocks;  // Block of each command
+    unsigned char *_code;
+    size_t _code_size;
+    FILE *_dump;
+};  // class PerfMap
+
+constexpr unsigned char PerfMap::Code[];
+
+////////////////
+// CHECKPOINT //
+////////////////
+
+/**
+ * Periodic checkpoints of a running program in an append-only file
+ * Every `interval` instructions a record is appended with the position, timer,
+ * instruction count, I/O offsets and the memory pages written since the
+ * previous record, so its cost scales with the pages dirtied in between. Page
+ * contents are page-aligned in the file and restoring maps the latest copy of
+ * each page into memory copy-on-write instead of reading it.
+ */
+class Checkpointer {
+ public:
+    /**
+     * Default number of instructions between two checkpoints
+     */
+    constexpr static size_t DefaultInterval = 1 << 26;
+
+    /**
+     * @param path        Path of the checkpoint file
+     * @param interval    Number of instructions between two checkpoints
+     * @param fingerprint Fingerprint of the program
+     * @param restoring   Whether `restore` is going to be called, otherwise
+     *                    the file is truncated
+     */
+    Checkpointer(const char *path,
+                 const size_t interval,
+                 const uint64_t fingerprint,
+                 const bool restoring)
+            : _interval(max<size_t>(interval, 1)),
+              _fingerprint(fingerprint),
+              _offset(0) {
+        _fd = open(path, restoring ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+        CHECK(_fd >= 0, InvalidArgument, "Cannot open checkpoint file");
+    }
+
+    ~Checkpointer() {
+        close(_fd);
+    }
+
+    /**
+     * Continue from the last complete record of the file
+     * An incomplete record left by a crash is discarded and later records are
+     * appended after the restored one. The input is moved to the recorded
+     * offset and a regular output file is truncated to it.
+     * @param env Environment prepared by `run_partical`
+     * @param in  Input file
+     * @param out Output file
+     */
+    void restore(Environment &env, FILE *in, FILE *out) {
+        struct stat info;
+        ASSERT(fstat(_fd, &info) == 0, "Cannot read checkpoint file");
+        size_t size = info.st_size;
+        CHECK(size >= sizeof(Record), InvalidArgument, "No checkpoint found");
+
+        void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        ASSERT(base != MAP_FAILED, "Cannot map checkpoint");
+
+        Record last;
+        bool found = false;
+        vector<off_t> location(env.memory.pages(), -1);
+        size_t offset = 0;
+        while (offset + sizeof(Record) <= size) {
+            Record record;
+            memcpy(&record, static_cast<char *>(base) + offset, sizeof(record));
+            if (memcmp(record.magic, Magic, sizeof(Magic)) != 0)
+                break;
+            CHECK(record.fingerprint == _fingerprint &&
+                          record.memory_size == env.memory.size(),
+                  InvalidArgument,
+                  "Checkpoint was written by another program");
+
+            size_t data = offset + header_size(record.pages);
+            size_t end = data + record.pages * MemoryPool::page_size();
+            if (end > size)
+                break;
+
+            auto pages = reinterpret_cast<const uint64_t *>(
+                    static_cast<char *>(base) + offset + sizeof(Record));
+            for (size_t i = 0; i < record.pages; i++) {
+                CHECK(pages[i] < location.size(),
+                      InvalidArgument,
+                      "Invalid checkpoint file");
+                location[pages[i]] = data + i * MemoryPool::page_size();
+            }  // for
+
+            last = record;
+            found = true;
+            offset = end;
+        }  // while
+        munmap(base, size);
+        CHECK(found, InvalidArgument, "No checkpoint found");
+
+        ASSERT(ftruncate(_fd, offset) == 0, "Cannot truncate checkpoint file");
+        _offset = offset;
+        for (size_t i = 0; i < location.size(); i++) {
+            if (location[i] >= 0)
+                env.memory.map_page(i, _fd, location[i]);
+        }  // for
+
+        env.current = last.current;
+        env.executed = last.executed;
+        env._group->timer = last.timer;
+
+        if (last.input_offset >= 0)
+            CHECK(fseek(in, last.input_offset, SEEK_SET) == 0,
+                  Unsupported,
+                  "Input is not seekable");
+
+        fflush(out);
+        if (last.output_offset >= 0 && fstat(fileno(out), &info) == 0 &&
+            S_ISREG(info.st_mode) && info.st_size >= last.output_offset &&
+            ftruncate(fileno(out), last.output_offset) == 0)
+            fseek(out, last.output_offset, SEEK_SET);
+
+        // The next record only holds pages written after the restore
+        env.memory.take_dirty();
+    }
+
+    /**
+     * Run the program, appending a record every `interval` instructions
+     * @param  env Environment prepared by `run_partical` or `restore`
+     * @param  in  Input file
+     * @param  out Output file
+     * @return     `Exited`, or `Failed` with the error in `env.error`
+     * @remark `SPAWN` is not supported, such programs fail
+     */
+    Program::Status run(Environment &env, FILE *in, FILE *out) {
+        Program::Status status;
+
+        Sampler::enter(&env);
+        while ((status = env.program->run_for(env, _interval)) ==
+               Program::Exhausted)
+            append(env, in, out);
+        Sampler::enter(nullptr);
+
+        return status;
+    }
+
+ private:
+    static const char Magic[4];
+
+    /**
+     * Header of a record, followed by the indexes of its pages as `uint64_t`
+     * and padding to the next page, then the contents of the pages
+     */
+    struct Record {
+        char magic[4];
+        uint32_t pages;
+        uint64_t fingerprint;
+        uint64_t memory_size;
+        int64_t current;
+        uint64_t timer;
+        uint64_t executed;
+        int64_t input_offset;   // -1 if not seekable
+        int64_t output_offset;  // -1 if not seekable
+    };  // struct Record
+
+    static size_t header_size(const size_t pages) {
+        size_t page = MemoryPool::page_size();
+        size_t size = sizeof(Record) + pages * sizeof(uint64_t);
+
+        return (size + page - 1) / page * page;
+    }
+
+    void append(Environment &env, FILE *in, FILE *out) {
+        fflush(out);
+
+        vector<size_t> pages = env.memory.take_dirty();
+        sort(pages.begin(), pages.end());
+
+        Record record;
+        memcpy(record.magic, Magic, sizeof(Magic));
+        record.pages = pages.size();
+        record.fingerprint = _fingerprint;
+        record.memory_size = env.memory.size();
+        record.current = env.current;
+        record.timer = env.passed_time();
+        record.executed = env.executed;
+        record.input_offset = ftell(in);
+        record.output_offset = ftell(out);
+
+        string header(header_size(pages.size()), '\0');
+        memcpy(&header[0], &record, sizeof(record));
+        for (size_t i = 0; i < pages.size(); i++) {
+            uint64_t page = pages[i];
+            memcpy(&header[sizeof(record) + i * sizeof(page)],
+                   &page,
+                   sizeof(page));
+        }  // for
+        write_at(header.data(), header.size());
+
+        // Adjacent pages are written at once
+        size_t page = MemoryPool::page_size();
+        for (size_t i = 0, j; i < pages.size(); i = j) {
+            for (j = i + 1; j < pages.size() && pages[j] == pages[j - 1] + 1;
+                 j++) {
+            }
+            write_at(env.memory.page(pages[i]), (j - i) * page);
+        }  // for
+    }
+
+    void write_at(const char *data, const size_t size) {
+        for (size_t done = 0; done < size;) {
+            ssize_t n = pwrite(_fd, data + done, size - done, _offset + done);
+            ASSERT(n > 0, "Cannot write checkpoint file");
+            done += n;
+        }  // for
+
+        _offset += size;
+    }
+
+    size_t _interval;
+    uint64_t _fingerprint;
+    int _fd;
+    off_t _offset;
+};  // class Checkpointer
+
+const char Checkpointer::Magic[4] = { 'M', 'C', 'P', '1' };
+
+//////////////
+// DEBUGGER //
+//////////////
+
+/**
+ * Interactive debugger able to run backwards
+ * A snapshot is taken every `interval` instructions. Memory is snapshotted by
+ * `MemoryPool`, which copies only pages written since the previous snapshot;
+ * their older contents are kept as the undo log of the snapshot. Going back
+ * reverts pages through the undo logs to the nearest earlier snapshot and
+ * re-executes at most one interval forward. Values read by `IN` are cached,
+ * so re-execution sees the same input, and `OUT` only prints values not
+ * printed before. When the undo logs exceed `MemoryBudget`, every other
+ * snapshot is merged into its predecessor and the interval doubles.
+ */
+class Debugger {
+ public:
+    /**
+     * Default number of instructions between two snapshots
+     */
+    constexpr static size_t DefaultInterval = 1 << 16;
+
+    /**
+     * Bytes of undo logs kept before snapshots are thinned
+     */
+    constexpr static size_t MemoryBudget = 256 << 20;
+
+    /**
+     * @param env      Environment prepared by `run_partical`
+     * @param path     Path of the program, to show source lines
+     * @param interval Initial number of instructions between snapshots
+     */
+    Debugger(Environment &env, const char *path, const size_t interval)
+            : _env(env),
+              _program(*env.program),
+              _input(env.input),
+              _interval(max<size_t>(interval, 1)),
+              _undo_bytes(0),
+              _failed(false) {
+        FILE *source = fopen(path, "r");
+        ASSERT(source != nullptr, "No ASM file found.");
+        char buffer[2048];
+        while (fgets(buffer, sizeof(buffer), source)) {
+            _source.push_back(buffer);
+            while (!_source.back().empty() && isspace(_source.back().back()))
+                _source.back().pop_back();
+        }  // while
+        fclose(source);
+
+        env.input = &_input;
+        env.output = &_output;
+        env.memory.snapshot();
+        _snapshots.push_back(state());
+    }
+
+    /**
+     * Read commands until `quit` or the end of `in`
+     * @param in Commands
+     */
+    void repl(FILE *in) {
+        char buffer[256];
+        string last;
+
+        where();
+        for (prompt(); fgets(buffer, sizeof(buffer), in); prompt()) {
+            string line = buffer;
+            if (line.find_first_not_of(" \t\r\n") == string::npos)
+                line = last;
+            last = line;
+
+            char command[32] = "";
+            long long a = -1, b = -1;
+            sscanf(line.c_str(), "%31s %lld %lld", command, &a, &b);
+            string name = command;
+
+            try {
+                if (name == "q" || name == "quit")
+                    return;
+                else if (name == "s" || name == "step")
+                    go_to(_env.executed + (a < 0 ? 1 : a));
+                else if (name == "rs" || name == "rstep")
+                    go_to(_env.executed - min<size_t>(a < 0 ? 1 : a,
+                                                      _env.executed));
+                else if (name == "c" || name == "continue")
+                    forward();
+                else if (name == "rc" || name == "rcontinue")
+                    backward();
+                else if (name == "g" || name == "goto")
+                    go_to(max<long long>(a, 0));
+                else if ((name == "b" || name == "break") && a > 0)
+                    _breakpoints.insert(a);
+                else if ((name == "d" || name == "delete") && a > 0)
+                    _breakpoints.erase(a);
+                else if ((name == "p" || name == "print") && a >= 0) {
+                    for (long long i = a; i < a + max<long long>(b, 1); i++)
+                        printf("[%lld] = %d\n", i, _env.memory[i]);
+                    continue;
+                } else if (name == "i" || name == "info") {
+                    info();
+                    continue;
+                } else if (name != "w" && name != "where") {
+                    puts("Commands: s/step [N], rs/rstep [N], c/continue, "
+                         "rc/rcontinue, g/goto COUNT, b/break LINE, "
+                         "d/delete LINE, p/print ADDR [LEN], w/where, i/info, "
+                         "q/quit");
+                    continue;
+                }
+            } catch (const Error &e) {
+                e.print(stdout);
+                continue;
+            }
+
+            where();
+        }  // for
+    }
+
+ private:
+    /**
+     * Input caching every value read, replayed after going back
+     * Reads past the end produce the value `IN` would store and cache it too.
+     */
+    class CachedInput final : public InputStream {
+     public:
+        CachedInput(InputStream *source) : source(source), cursor(0) {}
+
+        virtual Result read(int &value) {
+            if (cursor == values.size()) {
+                Result result = source->read(value);
+                if (result == Empty)
+                    return Empty;
+                if (result == End) {
+#if FRIENDLY_MODE
+                    value = 0;
+#else
+                    value = randint();
+#endif  // IF FRIENDLY_MODE
+                }
+
+                values.push_back(value);
+            }
+
+            value = values[cursor++];
+            return Ready;
+        }
+
+        InputStream *source;
+        vector<int> values;
+        size_t cursor;
+    };  // class CachedInput
+
+    /**
+     * Output printing each value once, however often it is re-executed
+     */
+    class OnceOutput final : public OutputStream {
+     public:
+        OnceOutput() : cursor(0), printed(0) {}
+
+        virtual bool write(const int value) {
+            if (cursor++ == printed) {
+                printf("OUT %d\n", value);
+                printed++;
+            }
+
+            return true;
+        }
+
+        size_t cursor;
+        size_t printed;
+    };  // class OnceOutput
+
+    struct Snapshot {
+        size_t executed;
+        int current;
+        size_t timer;
+        size_t input;
+        size_t output;
+
+        /**
+         * Pages written since the previous snapshot, with their contents at
+         * the previous snapshot
+         */
+        vector<pair<size_t, string>> undo;
+    };  // struct Snapshot
+
+    Snapshot state() const {
+        Snapshot snapshot;
+        snapshot.executed = _env.executed;
+        snapshot.current = _env.current;
+        snapshot.timer = _env.passed_time();
+        snapshot.input = _input.cursor;
+        snapshot.output = _output.cursor;
+
+        return snapshot;
+    }
+
+    void take_snapshot() {
+        Snapshot snapshot = state();
+        size_t page = MemoryPool::page_size();
+        for (auto i : _env.memory.dirty_pages())
+            snapshot.undo.emplace_back(
+                    i, string(_env.memory.saved_page(i), page));
+        _env.memory.snapshot();
+
+        _undo_bytes += snapshot.undo.size() * page;
+        _snapshots.push_back(move(snapshot));
+        if (_undo_bytes > MemoryBudget)
+            thin();
+    }
+
+    /**
+     * Merge every other snapshot into its predecessor and double the interval
+     */
+    void thin() {
+        vector<Snapshot> kept;
+        kept.push_back(move(_snapshots[0]));
+        for (size_t i = 1; i < _snapshots.size(); i += 2) {
+            if (i + 1 == _snapshots.size()) {
+                kept.push_back(move(_snapshots[i]));
+                break;
+            }
+
+            // The older contents of a page come from the earlier log
+            Snapshot &first = _snapshots[i];
+            Snapshot &second = _snapshots[i + 1];
+            unordered_set<size_t> pages;
+            for (auto &entry : first.undo)
+                pages.insert(entry.first);
+            for (auto &entry : second.undo) {
+                if (!pages.count(entry.first))
+                    first.undo.push_back(move(entry));
+                else
+                    _undo_bytes -= entry.second.size();
+            }  // foreach in second.undo
+
+            second.undo = move(first.undo);
+            kept.push_back(move(second));
+        }  // for
+
+        _snapshots = move(kept);
+        _interval *= 2;
+    }
+
+    /**
+     * Return to a snapshot, dropping the later ones
+     * @param index Index of the snapshot
+     */
+    void restore(const size_t index) {
+        _env.memory.reset();
+        while (_snapshots.size() > index + 1) {
+            for (auto &entry : _snapshots.back().undo) {
+                _env.memory.revert_page(entry.first, entry.second.data());
+                _undo_bytes -= entry.second.size();
+            }  // foreach in undo
+
+            _snapshots.pop_back();
+        }  // while
+
+        auto &snapshot = _snapshots[index];
+        _env.executed = snapshot.executed;
+        _env.current = snapshot.current;
+        _env._group->timer = snapshot.timer;
+        _input.cursor = snapshot.input;
+        _output.cursor = snapshot.output;
+        _env.error = Error();
+        _failed = false;
+    }
+
+    bool stopped() const {
+        return _failed || _env.exited();
+    }
+
+    bool at_breakpoint() const {
+        return !_env.exited() &&
+               _breakpoints.count(_program.line(_env.current));
+    }
+
+    /**
+     * Execute until `target` instructions were executed or the program stops
+     * @param target      Instruction count to reach
+     * @param breakpoints Whether to stop at breakpoints after the first step
+     */
+    void run_to(const size_t target, const bool breakpoints) {
+        bool first = true;
+        while (!stopped() && _env.executed < target) {
+            if (breakpoints && !first && at_breakpoint())
+                break;
+            first = false;
+
+            size_t boundary = _snapshots.back().executed + _interval;
+            size_t budget = breakpoints ? 1 : min(target, boundary) -
+                                                      _env.executed;
+            size_t executed = _env.executed;
+            Program::Status status = _program.run_for(_env, budget);
+            if (status == Program::Failed)
+                _failed = true;
+            if (status == Program::Blocked ||
+                (status == Program::Exhausted && _env.executed == executed))
+                break;
+
+            if (_env.executed >= boundary)
+                take_snapshot();
+        }  // while
+    }
+
+    /**
+     * Go to the point where `target` instructions were executed
+     */
+    void go_to(const size_t target) {
+        if (target < _env.executed) {
+            size_t index = _snapshots.size() - 1;
+            while (_snapshots[index].executed > target)
+                index--;
+            restore(index);
+        }
+
+        run_to(target, false);
+    }
+
+    void forward() {
+        run_to(SIZE_MAX, true);
+    }
 
-    virtual size_t execute(const void *_args) {
-        auto env = Instruction::env;
-        auto args = reinterpret_cast<const JifmArgs *>(_args);
-        DEBUGF("JIFM %d %d", GET(value1), GET(value2))
+    /**
+     * Go to the last breakpoint reached before the current point
+     * Intervals are scanned backwards, each executed at most twice.
+     */
+    void backward() {
+        size_t end = _env.executed;
+        size_t index = _snapshots.size() - 1;
+        while (index > 0 && _snapshots[index].executed >= end)
+            index--;
 
-        if (GET(value1))
-            env->current += GET(value2) - 1;
+        while (true) {
+            restore(index);
+
+            size_t hit = SIZE_MAX;
+            while (!stopped() && _env.executed < end) {
+                if (at_breakpoint())
+                    hit = _env.executed;
+                run_to(_env.executed + 1, false);
+            }  // while
+
+            if (hit != SIZE_MAX) {
+                go_to(hit);
+                return;
+            }
+            if (index == 0) {
+                go_to(0);
+                puts("Reached the beginning");
+                return;
+            }
 
-        return 0;
+            end = _snapshots[index].executed;
+            index--;
+        }  // while
     }
 
-    IMPLEMENT_BASIS(JifmArgs)
-};  // class JifmInstruction
+    void where() const {
+        if (_failed)
+            _env.error.print(stdout);
+        if (_env.exited()) {
+            printf("[%zu] exited\n", _env.executed);
+            return;
+        }
 
-#undef GET
-#undef IMPLEMENT_BASIS
+        int line = _program.line(_env.current);
+        printf("[%zu] line %d: %s\n",
+               _env.executed,
+               line,
+               0 < line && line <= static_cast<int>(_source.size())
+                       ? _source[line - 1].c_str()
+                       : "");
+    }
 
-void Program::run() {
-    while (!exited()) {
-        ASSERT(_timer <= Timelimit, "Time limit exceeded");
-        ASSERT(0 <= current && current < _commands.size(), "Invalid position");
+    void info() const {
+        printf("%zu snapshots every %zu instructions, %zu KiB of undo logs, "
+               "%zu values read\n",
+               _snapshots.size(),
+               _interval,
+               _undo_bytes >> 10,
+               _input.values.size());
+    }
 
-        Command &comm = _commands[current];
-        current++;
+    static void prompt() {
+        printf("(debug) ");
+        fflush(stdout);
+    }
 
-        if (typeid(*comm.instruction) == typeid(MemInstruction) ||
-            typeid(*comm.instruction) == typeid(TaggedNopInstruction))
-            continue;
+    Environment &_env;
+    const Program &_program;
+    CachedInput _input;
+    OnceOutput _output;
+    vector<string> _source;
+    unordered_set<int> _breakpoints;
+    vector<Snapshot> _snapshots;
+    size_t _interval;
+    size_t _undo_bytes;
+    bool _failed;
+};  // class Debugger
 
-        ASSERT(comm.instruction != nullptr, "Invalid instruction");
-        ASSERT(comm.args != nullptr, "Arguments missing");
-        _timer += comm.instruction->execute(comm.args);
-    }  // while
-}
+///////////////
+// BENCHMARK //
+///////////////
 
-void Program::run_partical() {
-    for (current = 0; current < _commands.size(); current++) {
-        Command &comm = _commands[current];
+/**
+ * File of benchmark results keyed by commit and host
+ * Every measured run appends one JSON line with all of its samples:
+ *
+ *     {"commit": "1a2b3c", "host": "box", "time": 1700000000,
+ *      "benchmark": "x.asm", "instructions": 42, "wall_ns": [10, 11, 12]}
+ *
+ * (on a single line). Two commits are compared with Welch's t-test on the
+ * samples of all runs of each commit on the current host.
+ */
+class History {
+ public:
+    /**
+     * Smallest relative change of the mean reported as a regression
+     */
+    constexpr static double MinimumChange = 0.02;
 
-        if (typeid(*comm.instruction) == typeid(MemInstruction) ||
-            typeid(*comm.instruction) == typeid(TaggedNopInstruction)) {
-            comm.instruction->execute(comm.args);
+    /**
+     * @param path   Path of the history file
+     * @param commit Commit of the measured interpreter, NULL for
+     * `MINIASM_COMMIT`
+     */
+    History(const char *path, const char *commit)
+            : _path(path),
+              _commit(commit ? commit : MINIASM_COMMIT),
+              _host(current_host()) {
+        CHECK(!_commit.empty(),
+              InvalidArgument,
+              "Unknown commit, use --commit or build with -DMINIASM_COMMIT");
+    }
+
+    /**
+     * Append the samples of one run
+     * @param benchmark    Path of the program
+     * @param instructions Instructions executed by one run
+     * @param times        Wall time of every run in nanoseconds
+     */
+    void append(const char *benchmark,
+                const size_t instructions,
+                const vector<uint64_t> &times) const {
+        string line = "{\"commit\": \"" + _commit + "\", \"host\": \"" +
+                      _host + "\", \"time\": " + to_string(time(nullptr)) +
+                      ", \"benchmark\": \"" + benchmark +
+                      "\", \"instructions\": " + to_string(instructions) +
+                      ", \"wall_ns\": [";
+        for (size_t i = 0; i < times.size(); i++)
+            line += (i ? ", " : "") + to_string(times[i]);
+        line += "]}\n";
+
+        // One `write` to an `O_APPEND` file keeps concurrent runs apart
+        int fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        ASSERT(fd >= 0, "Cannot open history file");
+        ssize_t written = write(fd, line.data(), line.size());
+        close(fd);
+        ASSERT(written == static_cast<ssize_t>(line.size()),
+               "Cannot write history file");
+    }
+
+    /**
+     * Compare two commits and print one JSON object per benchmark
+     * A benchmark is `slower` or `faster` when the 95% confidence interval of
+     * the change of its mean wall time excludes zero and the change is at
+     * least `MinimumChange`. Commits match by prefix.
+     * @param  base   Commit measured before
+     * @param  head   Commit measured after
+     * @param  report Target file
+     * @return        Whether every benchmark has enough samples of both
+     * commits and none became slower
+     */
+    bool compare(const char *base, const char *head, FILE *report) const {
+        vector<string> names;
+        unordered_map<string, vector<uint64_t>> before, after;
+        load(base, before, names);
+        load(head, after, names);
+        CHECK(!names.empty(),
+              InvalidArgument,
+              "No results of these commits on this host");
+
+        bool ok = true;
+        for (auto &name : names) {
+            auto &a = before[name];
+            auto &b = after[name];
+            fprintf(report, "{\"benchmark\": \"%s\"", name.c_str());
+
+            if (a.size() < 2 || b.size() < 2) {
+                ok = false;
+                fprintf(report,
+                        ", \"base_samples\": %zu, \"head_samples\": %zu, "
+                        "\"verdict\": \"insufficient\"}\n",
+                        a.size(),
+                        b.size());
+                continue;
+            }
+
+            double mean_a, var_a, mean_b, var_b;
+            statistics(a, mean_a, var_a);
+            statistics(b, mean_b, var_b);
+
+            // Welch's t-test with the Welch-Satterthwaite degrees of freedom
+            double sa = var_a / a.size(), sb = var_b / b.size();
+            double se = sqrt(sa + sb);
+            double df = se > 0 ? (sa + sb) * (sa + sb) /
+                                         (sa * sa / (a.size() - 1) +
+                                          sb * sb / (b.size() - 1))
+                               : HUGE_VAL;
+            double diff = mean_b - mean_a;
+            double low = (diff - t_quantile(df) * se) / mean_a;
+            double high = (diff + t_quantile(df) * se) / mean_a;
+            double change = diff / mean_a;
+
+            const char *verdict = "unchanged";
+            if (low > 0 && change >= MinimumChange)
+                verdict = "slower";
+            else if (high < 0 && -change >= MinimumChange)
+                verdict = "faster";
+            ok &= strcmp(verdict, "slower") != 0;
+
+            fprintf(report,
+                    ", \"base_ns\": %.0f, \"head_ns\": %.0f, "
+                    "\"change\": %.4f, \"ci95\": [%.4f, %.4f], "
+                    "\"base_samples\": %zu, \"head_samples\": %zu, "
+                    "\"verdict\": \"%s\"}\n",
+                    mean_a,
+                    mean_b,
+                    change,
+                    low,
+                    high,
+                    a.size(),
+                    b.size(),
+                    verdict);
+        }  // foreach in names
+
+        return ok;
+    }
+
+ private:
+    static string current_host() {
+        char buffer[256];
+        if (gethostname(buffer, sizeof(buffer)) != 0)
+            return "unknown";
+        buffer[sizeof(buffer) - 1] = '\0';
+
+        return buffer;
+    }
+
+    /**
+     * Raw text of a field of a history line, without quotes for strings
+     */
+    static bool field(const string &line, const char *key, string &value) {
+        string pattern = string("\"") + key + "\": ";
+        size_t pos = line.find(pattern);
+        if (pos == string::npos)
+            return false;
+        pos += pattern.size();
+
+        size_t end;
+        if (line[pos] == '"')
+            end = line.find('"', ++pos);
+        else if (line[pos] == '[')
+            end = line.find(']', ++pos);
+        else
+            end = line.find_first_of(",}", pos);
+        if (end == string::npos)
+            return false;
+
+        value = line.substr(pos, end - pos);
+        return true;
+    }
+
+    /**
+     * Collect the samples of a commit on this host
+     * @param commit  Commit prefix
+     * @param samples Samples of each benchmark
+     * @param names   Receives new benchmark names in order of appearance
+     */
+    void load(const char *commit,
+              unordered_map<string, vector<uint64_t>> &samples,
+              vector<string> &names) const {
+        FILE *in = fopen(_path.c_str(), "r");
+        CHECK(in != nullptr, InvalidArgument, "No history file found");
+
+        string line, value, name, times;
+        char buffer[4096];
+        while (fgets(buffer, sizeof(buffer), in)) {
+            line += buffer;
+            if (line.back() != '\n' && !feof(in))
+                continue;
+
+            if (field(line, "commit", value) &&
+                value.compare(0, strlen(commit), commit) == 0 &&
+                field(line, "host", value) && value == _host &&
+                field(line, "benchmark", name) &&
+                field(line, "wall_ns", times)) {
+                if (find(names.begin(), names.end(), name) == names.end())
+                    names.push_back(name);
+
+                char *end;
+                for (const char *p = times.c_str();; p = end) {
+                    uint64_t t = strtoull(p, &end, 10);
+                    if (end == p)
+                        break;
+                    samples[name].push_back(t);
+                    while (*end == ',' || *end == ' ')
+                        end++;
+                }  // for
+            }
+
+            line.clear();
+        }  // while
+
+        fclose(in);
+    }
+
+    static void statistics(const vector<uint64_t> &samples,
+                           double &mean,
+                           double &variance) {
+        mean = 0;
+        for (auto t : samples)
+            mean += t;
+        mean /= samples.size();
+
+        variance = 0;
+        for (auto t : samples)
+            variance += (t - mean) * (t - mean);
+        variance /= samples.size() - 1;
+    }
+
+    /**
+     * Two-sided 95% quantile of Student's t distribution
+     * Cornish-Fisher expansion around the normal quantile, within 1% for
+     * three or more degrees of freedom.
+     */
+    static double t_quantile(const double df) {
+        const double z = 1.959964;
+        double z3 = z * z * z, z5 = z3 * z * z, z7 = z5 * z * z;
+
+        return z + (z3 + z) / (4 * df) +
+               (5 * z5 + 16 * z3 + 3 * z) / (96 * df * df) +
+               (3 * z7 + 19 * z5 + 17 * z3 - 15 * z) / (384 * df * df * df);
+    }
+
+    string _path;
+    string _commit;
+    string _host;
+};  // class History
+
+/**
+ * Harness measuring the speed of whole programs
+ * Every program is measured in its own child process, so the peak resident
+ * set size belongs to that program alone. The input of `x.asm` is `x.in` if it
+ * exists; the output is discarded.
+ */
+class Benchmark {
+ public:
+    /**
+     * @param warmup  Unmeasured runs of each program
+     * @param repeat  Measured runs of each program
+     * @param history History receiving the samples, NULL for none
+     */
+    Benchmark(const size_t warmup,
+              const size_t repeat,
+              const History *history = nullptr)
+            : _warmup(warmup),
+              _repeat(max<size_t>(repeat, 1)),
+              _history(history) {}
+
+    /**
+     * Measure a program and print one JSON object per line
+     * @param  path   Path of the program
+     * @param  report Target file
+     * @return        Whether the program loaded and ran without errors
+     */
+    bool run(const char *path, FILE *report) const {
+        fflush(nullptr);
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "Cannot fork");
+
+        if (pid == 0) {
+            bool ok = measure(path, report);
+            fflush(report);
+            _exit(ok ? 0 : 1);
         }
-    }  // for
 
-    current = 0;
-}
+        int status;
+        waitpid(pid, &status, 0);
 
-///////////
-// TOKEN //
-///////////
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
 
-struct Token {
-    constexpr static size_t MaxLexemeLength = 4096;
+ private:
+    static string input_path(const string &path) {
+        const string suffix = ".asm";
+        if (path.size() >= suffix.size() &&
+            path.compare(path.size() - suffix.size(), suffix.size(), suffix) ==
+                    0)
+            return path.substr(0, path.size() - suffix.size()) + ".in";
+        return path + ".in";
+    }
 
-    Token() : size(0), lexeme(nullptr) {}
+    /**
+     * Run the program once
+     * @param  program Loaded program
+     * @param  input   Path of the input file, empty for no input
+     * @param  env     Receives the counters of the run
+     * @return         Wall time in nanoseconds
+     */
+    static uint64_t run_once(const Program &program,
+                             const string &input,
+                             unique_ptr<Environment> &env) {
+        FILE *in = fopen(input.empty() ? "/dev/null" : input.c_str(), "r");
+        FILE *out = fopen("/dev/null", "w");
+        ASSERT(in != nullptr && out != nullptr, "Cannot open benchmark I/O");
+
+        auto start = chrono::steady_clock::now();
+        env.reset(new Environment(program));
+        env->open(in, out);
+        program.run_partical(*env);
+        Program::Status status = program.run(*env);
+        fflush(out);
+        auto end = chrono::steady_clock::now();
+
+        fclose(in);
+        fclose(out);
+        if (status == Program::Failed)
+            throw env->error;
+
+        return chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    }
 
-    Token(const char *buffer) : lexeme(nullptr) {
-        store(buffer);
+    bool measure(const char *path, FILE *report) const {
+        try {
+            FileGuard source(fopen(path, "r"), fclose);
+            ASSERT(source != nullptr, "No ASM file found.");
+            Program program;
+            Parser().load(source.get(), program);
+            source.reset();
+
+            string input = input_path(path);
+            if (access(input.c_str(), R_OK) != 0)
+                input.clear();
+
+            unique_ptr<Environment> env;
+            for (size_t i = 0; i < _warmup; i++)
+                run_once(program, input, env);
+
+            vector<uint64_t> times;
+            for (size_t i = 0; i < _repeat; i++)
+                times.push_back(run_once(program, input, env));
+            sort(times.begin(), times.end());
+
+            uint64_t sum = 0;
+            for (auto t : times)
+                sum += t;
+            uint64_t median = times[times.size() / 2];
+            size_t instructions = env->instruction_count();
+
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+
+            if (_history)
+                _history->append(path, instructions, times);
+
+            fprintf(report,
+                    "{\"benchmark\": \"%s\", \"instructions\": %zu, "
+                    "\"repeat\": %zu, \"wall_ns\": {\"min\": %llu, "
+                    "\"median\": %llu, \"mean\": %llu, \"max\": %llu}, "
+                    "\"instructions_per_second\": %.0f, "
+                    "\"peak_rss_kb\": %ld}\n",
+                    path,
+                    instructions,
+                    times.size(),
+                    static_cast<unsigned long long>(times.front()),
+                    static_cast<unsigned long long>(median),
+                    static_cast<unsigned long long>(sum / times.size()),
+                    static_cast<unsigned long long>(times.back()),
+                    instructions * 1e9 / max<uint64_t>(median, 1),
+                    usage.ru_maxrss);
+
+            return true;
+        } catch (const Error &e) {
+            fprintf(report,
+                    "{\"benchmark\": \"%s\", \"error\": \"%s\"}\n",
+                    path,
+                    e.message);
+
+            return false;
+        }
     }
 
-    Token(const char *buffer, const size_t beg, const size_t end)
-            : lexeme(nullptr) {
-        store(buffer, beg, end);
+    size_t _warmup;
+    size_t _repeat;
+    const History *_history;
+};  // class Benchmark
+
+/**
+ * Generated programs isolating the cost of one opcode
+ * Every opcode is measured with its operands at several dereference depths,
+ * both as a long straight-line sequence and as the body of a counted loop,
+ * on every execution engine: `run`, `run_for` and `run_slice`. The cost of
+ * a looped opcode is the loop time minus the time of the empty loop, run
+ * alternately with it. It is `null` when the difference is within the noise.
+ */
+class MicroBenchmark {
+ public:
+    /**
+     * Copies of the opcode in a straight-line program
+     */
+    constexpr static size_t StraightLength = 1 << 16;
+
+    /**
+     * Iterations of a looped program
+     */
+    constexpr static size_t LoopIterations = 1 << 18;
+
+    /**
+     * Share of the empty loop time within which a looped program is
+     * considered as fast as the empty loop
+     */
+    constexpr static double Noise = 0.02;
+
+    MicroBenchmark(const size_t repeat) : _repeat(max<size_t>(repeat, 1)) {}
+
+    /**
+     * Measure opcodes and print one JSON object per line
+     * @param filter Names of opcodes to measure, all if empty
+     * @param report Target file
+     */
+    void run(const vector<const char *> &filter, FILE *report) const {
+        const char *engines[] = { "run", "run_for", "run_slice" };
+        const int depths[] = { 0, 1, 2, 4 };
+
+        string empty = generate(nullptr, 0, true);
+
+        for (auto engine : engines) {
+            for (auto &op : operations()) {
+                if (!filter.empty() &&
+                    find_if(filter.begin(), filter.end(), [&op](const char *s) {
+                        return strcmp(s, op.name) == 0;
+                    }) == filter.end())
+                    continue;
+
+                for (auto depth : depths) {
+                    // Operands of `NOP` and `JOIN` have no depth
+                    if (depth > 0 && op.operands[0] == '\0')
+                        break;
+
+                    double straight =
+                            measure(generate(&op, depth, false), engine) /
+                            StraightLength;
+
+                    // The empty loop is measured along with every program,
+                    // so both see the same machine state
+                    double loop, baseline;
+                    measure(generate(&op, depth, true),
+                            empty,
+                            engine,
+                            loop,
+                            baseline);
+
+                    char looped[32] = "null";
+                    if (loop - baseline > baseline * Noise)
+                        snprintf(looped,
+                                 sizeof(looped),
+                                 "%.3f",
+                                 (loop - baseline) / LoopIterations);
+
+                    fprintf(report,
+                            "{\"engine\": \"%s\", \"opcode\": \"%s\", "
+                            "\"depth\": %d, \"straight_ns\": %.3f, "
+                            "\"looped_ns\": %s}\n",
+                            engine,
+                            op.name,
+                            depth,
+                            straight,
+                            looped);
+                    fflush(report);
+                }  // foreach in depths
+            }  // foreach in operations()
+        }  // foreach in engines
     }
 
-    Token(const Token &b) {
-        store(b.lexeme);
+ private:
+    /**
+     * Opcode and the shape of its operands
+     * `operands` has one letter per operand: `v` for a value and `i` for an
+     * index. `values` are what the value operands evaluate to, in order.
+     */
+    struct Operation {
+        const char *name;
+        const char *operands;
+        int values[3];
+    };  // struct Operation
+
+    static const vector<Operation> &operations() {
+        // Jumps land on the next command. Indices before the last operand
+        // are 100, 200 and 300, e.g. 8-cell vectors, the last one is 10.
+        static const vector<Operation> result = {
+            { "NOP", "", {} },           { "SET", "vi", { 7 } },
+            { "ADD", "vvi", { 7, 3 } },  { "SUB", "vvi", { 7, 3 } },
+            { "MUL", "vvi", { 7, 3 } },  { "DIV", "vvi", { 7, 3 } },
+            { "MOD", "vvi", { 7, 3 } },  { "INC", "vi", { 7 } },
+            { "DEC", "vi", { 7 } },      { "NEC", "vi", { 7 } },
+            { "AND", "vvi", { 7, 3 } },  { "OR", "vvi", { 7, 3 } },
+            { "XOR", "vvi", { 7, 3 } },  { "FLIP", "vi", { 7 } },
+            { "NOT", "vi", { 7 } },      { "SHL", "vvi", { 7, 3 } },
+            { "SHR", "vvi", { 7, 3 } },  { "ROL", "vvi", { 7, 3 } },
+            { "ROR", "vvi", { 7, 3 } },  { "EQU", "vvi", { 7, 3 } },
+            { "GTER", "vvi", { 7, 3 } }, { "LESS", "vvi", { 7, 3 } },
+            { "GEQ", "vvi", { 7, 3 } },  { "LEQ", "vvi", { 7, 3 } },
+            { "JMOV", "v", { 1 } },      { "JIF", "vv", { 0, 0 } },
+            { "JIFM", "vv", { 1, 1 } },  { "VADD", "iiiv", { 8 } },
+            { "VSUB", "iiiv", { 8 } },   { "VMUL", "iiiv", { 8 } },
+            { "VCMP", "iiiv", { 8 } },   { "VSUM", "iiv", { 8 } },
+            { "VMAX", "iiv", { 8 } },    { "CAS", "ivvi", { 7, 3 } },
+            { "FADD", "ivi", { 7 } },    { "XCHG", "ivi", { 7 } }
+        };
+
+        return result;
     }
 
-    Token(Token &&b) : size(b.size), lexeme(b.lexeme) {
-        b.size = 0;
-        b.lexeme = nullptr;
+    /**
+     * Generate a program
+     * Operand `k` at depth `d` is `d` stars followed by the first cell of a
+     * chain set up so that dereferencing it `d` times yields `k`.
+     * @param op     Measured operation, NULL for the empty loop
+     * @param depth  Dereference depth of every operand
+     * @param looped Whether to emit a loop instead of straight-line code
+     */
+    static string generate(const Operation *op, const int depth, bool looped) {
+        string setup = "MEM 4096\n";
+        string command;
+        int chain = 400;
+
+        auto operand = [&](const int k) {
+            if (depth == 0)
+                return to_string(k);
+
+            for (int i = 0; i < depth; i++) {
+                int next = i + 1 < depth ? chain + i + 1 : k;
+                setup += "SET " + to_string(next) + " " +
+                         to_string(chain + i) + "\n";
+            }  // for
+
+            string result = string(depth, '*') + to_string(chain);
+            chain += depth;
+
+            return result;
+        };
+
+        if (op) {
+            command = op->name;
+            const int indices[] = { 100, 200, 300 };
+            size_t values = 0, index = 0;
+
+            for (const char *p = op->operands; *p; p++) {
+                command += " ";
+                if (*p == 'v')
+                    command += operand(op->values[values++]);
+                else if (p[1] != '\0')
+                    command += operand(indices[index++]);
+                else
+                    command += operand(10);
+            }  // for
+            command += "\n";
+        }
+
+        if (!looped) {
+            string text = setup;
+            for (size_t i = 0; i < StraightLength; i++)
+                text += command;
+
+            return text;
+        }
+
+        return setup + "SET 0 1\nNOP 2\n" + command + "INC *1 1\nLESS *1 " +
+               to_string(LoopIterations) + " 3\nJIF *3 *2\n";
     }
 
-    Token &operator=(const Token &b) {
-        this->store(b.lexeme);
+    /**
+     * Best wall time of `_repeat` runs in nanoseconds
+     */
+    double measure(const string &text, const char *engine) const {
+        Program program;
+        load(text, program);
 
-        return *this;
+        uint64_t best = UINT64_MAX;
+        for (size_t i = 0; i < _repeat; i++)
+            best = min(best, run_once(program, engine));
+
+        return best;
     }
 
-    Token &operator=(Token &&b) {
-        size = b.size;
-        lexeme = b.lexeme;
-        b.size = 0;
-        b.lexeme = nullptr;
+    /**
+     * Best wall times of `_repeat` runs of two programs, run alternately
+     */
+    void measure(const string &first_text,
+                 const string &second_text,
+                 const char *engine,
+                 double &first_best,
+                 double &second_best) const {
+        Program first, second;
+        load(first_text, first);
+        load(second_text, second);
+
+        uint64_t first_time = UINT64_MAX, second_time = UINT64_MAX;
+        for (size_t i = 0; i < _repeat; i++) {
+            first_time = min(first_time, run_once(first, engine));
+            second_time = min(second_time, run_once(second, engine));
+        }  // for
 
-        return *this;
+        first_best = first_time;
+        second_best = second_time;
     }
 
-    ~Token() {
-        if (lexeme)
-            delete lexeme;
+    static void load(const string &text, Program &program) {
+        FileGuard in(
+                fmemopen(const_cast<char *>(text.data()), text.size(), "r"),
+                fclose);
+        ASSERT(in != nullptr, "(internal) Cannot open program text");
+        Parser().load(in.get(), program);
     }
 
-    void store(const char *buffer,
-               const size_t beg = 0,
-               const size_t end = UINT_MAX) {
-        if (end < UINT_MAX)
-            size = end - beg;
-        else
-            size = strlen(buffer + beg);
+    /**
+     * Wall time of one run in nanoseconds
+     */
+    static uint64_t run_once(const Program &program, const char *engine) {
+        const size_t quantum = Environment::DefaultQuantum;
+        Environment env(program);
+        program.run_partical(env);
+
+        auto start = chrono::steady_clock::now();
+        Program::Status status;
+        if (strcmp(engine, "run_for") == 0) {
+            do
+                status = program.run_for(env, quantum);
+            while (status == Program::Exhausted);
+        } else if (strcmp(engine, "run_slice") == 0) {
+            do
+                status = program.run_slice(env, quantum);
+            while (status == Program::Exhausted);
+        } else
+            status = program.run(env);
+        auto end = chrono::steady_clock::now();
+
+        if (status == Program::Failed)
+            throw env.error;
+        return chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    }
+
+    size_t _repeat;
+};  // class MicroBenchmark
+
+/**
+ * Throughput of loading a program, phase by phase
+ * The tokenizer reads lines with `fgets` from a copy of the file in memory,
+ * so disk speed does not count. The parser is timed on the tokens it produced
+ * and memory initialization as `run_partical`.
+ */
+class LoaderBenchmark {
+ public:
+    LoaderBenchmark(const size_t repeat) : _repeat(max<size_t>(repeat, 1)) {}
+
+    /**
+     * Measure a program and print one JSON object
+     * @param path   Path of the program
+     * @param report Target file
+     */
+    void run(const char *path, FILE *report) const {
+        FILE *in = fopen(path, "r");
+        ASSERT(in != nullptr, "No ASM file found.");
+        string text;
+        vector<char> chunk(1 << 16);
+        size_t n;
+        while ((n = fread(chunk.data(), 1, chunk.size(), in)) > 0)
+            text.append(chunk.data(), n);
+        fclose(in);
+
+        size_t lines = count(text.begin(), text.end(), '\n');
+        if (!text.empty() && text.back() != '\n')
+            lines++;
+
+        double tokenize = HUGE_VAL, parse = HUGE_VAL, initialize = HUGE_VAL;
+        for (size_t i = 0; i < _repeat; i++) {
+            auto start = chrono::steady_clock::now();
+            vector<Parser::TokenList> tokens = tokenize_all(text);
+            auto tokenized = chrono::steady_clock::now();
+
+            Program program;
+            Parser().load(tokens, program);
+            auto parsed = chrono::steady_clock::now();
+
+            Environment env(program);
+            program.run_partical(env);
+            auto initialized = chrono::steady_clock::now();
+
+            tokenize = min(tokenize, seconds(start, tokenized));
+            parse = min(parse, seconds(tokenized, parsed));
+            initialize = min(initialize, seconds(parsed, initialized));
+        }  // for
+
+        fprintf(report,
+                "{\"program\": \"%s\", \"bytes\": %zu, \"lines\": %zu",
+                path,
+                text.size(),
+                lines);
+        print_phase(report, "tokenizer", tokenize, text.size(), lines);
+        print_phase(report, "parser", parse, text.size(), lines);
+        print_phase(report, "run_partical", initialize, text.size(), lines);
+        fprintf(report, "}\n");
+    }
+
+ private:
+    static FILE *open_text(const string &text) {
+        // `fmemopen` rejects empty buffers
+        FILE *in = fmemopen(const_cast<char *>(text.data()),
+                            max<size_t>(text.size(), 1),
+                            "r");
+        ASSERT(in != nullptr, "(internal) Cannot open program text");
+
+        return in;
+    }
+
+    /**
+     * Read and tokenize every line the way `Parser::load` does
+     */
+    static vector<Parser::TokenList> tokenize_all(const string &text) {
+        Tokenizer tokenizer;
+        FILE *in = open_text(text);
+        char buffer[2048];
+        vector<Parser::TokenList> lines;
+
+        while (fgets(buffer, sizeof(buffer), in))
+            lines.push_back(tokenizer.tokenize(buffer));
+        fclose(in);
+
+        return lines;
+    }
+
+    static double seconds(const chrono::steady_clock::time_point &start,
+                          const chrono::steady_clock::time_point &end) {
+        return chrono::duration<double>(end - start).count();
+    }
+
+    static void print_phase(FILE *report,
+                            const char *name,
+                            const double time,
+                            const size_t bytes,
+                            const size_t lines) {
+        double t = max(time, 1e-9);
+
+        fprintf(report,
+                ", \"%s\": {\"seconds\": %.6f, \"mb_per_second\": %.2f, "
+                "\"lines_per_second\": %.0f}",
+                name,
+                time,
+                bytes / t / 1e6,
+                lines / t);
+    }
+
+    size_t _repeat;
+};  // class LoaderBenchmark
+
+///////////////
+// GENERATOR //
+///////////////
+
+/**
+ * Generator of large valid programs
+ * Commands are drawn from categories with configurable weights. Programs only
+ * index cells below `DataCells`, divide by non-zero literals and jump forward
+ * to tagged `NOP` labels, so they also run to completion.
+ */
+class Generator {
+ public:
+    /**
+     * Cells used by generated commands
+     */
+    constexpr static int DataCells = 4096;
+
+    /**
+     * Cells holding label positions, starting at `DataCells`
+     */
+    constexpr static int LabelCells = 4096;
+
+    /**
+     * Command categories
+     */
+    enum Category {
+        Move,
+        Arithmetic,
+        Logic,
+        Compare,
+        Jump,
+        Vector,
+        Label,
+        Comment,
+        Blank,
+        CategoryCount
+    };  // enum Category
+
+    /**
+     * @param seed Seed of the pseudo-random generator
+     */
+    Generator(const unsigned seed)
+            : _random(seed),
+              _weights{ 15, 30, 15, 10, 5, 3, 4, 12, 6 },
+              _labels(0) {}
+
+    /**
+     * Set weights like `arith:30,jump:5,comment:0`
+     * Names are `move`, `arith`, `logic`, `compare`, `jump`, `vector`,
+     * `label`, `comment` and `blank`; unnamed categories keep their weight.
+     * @param spec Weight list
+     */
+    void set_mix(const char *spec) {
+        const char *names[CategoryCount] = { "move",   "arith", "logic",
+                                             "compare", "jump", "vector",
+                                             "label",  "comment", "blank" };
+
+        string text = spec;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find(',', pos);
+            if (end == string::npos)
+                end = text.size();
+
+            string item = text.substr(pos, end - pos);
+            size_t colon = item.find(':');
+            CHECK(colon != string::npos, InvalidArgument, "Invalid mix");
+
+            string name = item.substr(0, colon);
+            auto iter = find_if(names,
+                                names + CategoryCount,
+                                [&name](const char *s) { return name == s; });
+            CHECK(iter != names + CategoryCount,
+                  InvalidArgument,
+                  "Unknown mix category");
+            _weights[iter - names] = atoi(item.c_str() + colon + 1);
+
+            pos = end + 1;
+        }  // while
+    }
+
+    /**
+     * Write a program
+     * @param lines Number of lines
+     * @param out   Target file
+     */
+    void generate(const size_t lines, FILE *out) {
+        discrete_distribution<int> pick(_weights, _weights + CategoryCount);
+
+        fprintf(out, "MEM %d\n", DataCells + LabelCells);
+        fprintf(out, "# Generated program, %zu lines\n", lines);
+        for (size_t i = 2; i + 1 < lines; i++)
+            line(static_cast<Category>(pick(_random)), out);
+
+        // Every jump goes to the label after it, make sure it exists
+        if (lines > 2)
+            fprintf(out, "NOP %zu\n", DataCells + _labels % LabelCells);
+    }
+
+ private:
+    void line(const Category category, FILE *out) {
+        static const char *arithmetic[] = { "ADD", "SUB", "MUL" };
+        static const char *unary[] = { "INC", "DEC", "NEC", "FLIP", "NOT" };
+        static const char *logic[] = { "AND", "OR", "XOR", "SHL", "SHR",
+                                       "ROL", "ROR" };
+        static const char *compare[] = { "EQU", "GTER", "LESS", "GEQ", "LEQ" };
+        static const char *vector[] = { "VADD", "VSUB", "VMUL", "VCMP" };
+
+        switch (category) {
+            case Move:
+                fprintf(out, "SET %s %d\n", value().c_str(), cell());
+                break;
+            case Arithmetic:
+                switch (uniform(4)) {
+                    case 0:
+                        fprintf(out,
+                                "%s %s %d\n",
+                                unary[uniform(5)],
+                                value().c_str(),
+                                cell());
+                        break;
+                    case 1:
+                        fprintf(out,
+                                "%s %s %d %d\n",
+                                uniform(2) ? "DIV" : "MOD",
+                                value().c_str(),
+                                1 + uniform(1000),
+                                cell());
+                        break;
+                    default:
+                        fprintf(out,
+                                "%s %s %s %d  # %s\n",
+                                arithmetic[uniform(3)],
+                                value().c_str(),
+                                value().c_str(),
+                                cell(),
+                                "update a cell");
+                        break;
+                }  // switch
+                break;
+            case Logic:
+                fprintf(out,
+                        "%s %s %d %d\n",
+                        logic[uniform(7)],
+                        value().c_str(),
+                        uniform(32),
+                        cell());
+                break;
+            case Compare:
+                fprintf(out,
+                        "%s %s %s %d\n",
+                        compare[uniform(5)],
+                        value().c_str(),
+                        value().c_str(),
+                        cell());
+                break;
+            case Jump: {
+                int label = DataCells + _labels % LabelCells;
+                switch (uniform(3)) {
+                    case 0: fprintf(out, "JMP *%d\n", label); break;
+                    case 1:
+                        fprintf(out, "JIF *%d *%d\n", cell(), label);
+                        break;
+                    default:
+                        fprintf(out, "JIFM *%d %d\n", cell(), 1 + uniform(4));
+                        break;
+                }  // switch
+            } break;
+            case Vector: {
+                int length = 1 + uniform(64);
+                fprintf(out,
+                        "%s %d %d %d %d\n",
+                        vector[uniform(4)],
+                        uniform(DataCells - 64),
+                        uniform(DataCells - 64),
+                        uniform(DataCells - 64),
+                        length);
+            } break;
+            case Label:
+                fprintf(out,
+                        "NOP %zu  # label %zu\n",
+                        DataCells + _labels % LabelCells,
+                        _labels);
+                _labels++;
+                break;
+            case Comment:
+                fprintf(out, "# step %d: %s\n", uniform(100000), "compute");
+                break;
+            case Blank:
+            case CategoryCount: fprintf(out, "\n"); break;
+        }  // switch
+    }
+
+    int uniform(const int n) {
+        return uniform_int_distribution<int>(0, n - 1)(_random);
+    }
+
+    int cell() {
+        return uniform(DataCells);
+    }
+
+    /**
+     * A literal or a cell read once
+     */
+    string value() {
+        if (uniform(2))
+            return to_string(uniform(2000) - 1000);
+        return "*" + to_string(cell());
+    }
+
+    mt19937 _random;
+    double _weights[CategoryCount];
+    size_t _labels;
+};  // class Generator
+
+///////////////////
+// MAIN FUNCTION //
+///////////////////
+
+void usage() {
+    puts("Usage: miniasm++ [options] [program.asm]");
+    puts("       miniasm++ --batch program.asm input_dir output_dir [options]");
+    puts("       miniasm++ --server socket [options]");
+    puts("       miniasm++ --submit socket program.asm < input");
+    puts("       miniasm++ --stream program.asm");
+    puts("       miniasm++ --pipeline program.asm program.asm...");
+    puts("       miniasm++ --fork-server program.asm [options]");
+    puts("       miniasm++ --bench program.asm... [options]");
+    puts("       miniasm++ --compare BASE HEAD --history FILE");
+    puts("       miniasm++ --microbench [OPCODE...] [options]");
+    puts("       miniasm++ --bench-loader program.asm... [options]");
+    puts("       miniasm++ --generate LINES [--seed N] [--mix SPEC]");
+    puts("Options:");
+    puts("  -j N           Batch or server workers, or concurrent runs");
+    puts("  --threads N    Number of OS threads running SPAWN threads");
+    puts("  --quantum N    Instructions a SPAWN thread runs before preemption");
+    puts("  --profile FMT  Print executions per opcode and command to stderr,");
+    puts("                 FMT is text, json, lines or folded");
+    puts("  --sample HZ    Profile by sampling HZ times per CPU second");
+    puts("  --warmup N     Unmeasured runs of each benchmark (default 1)");
+    puts("  --repeat N     Measured runs of each benchmark (default 5)");
+    puts("  --history FILE Append --bench results to FILE");
+    puts("  --commit REV   Commit recorded in the history (default the commit");
+    puts("                 given by -DMINIASM_COMMIT at build time)");
+    puts("  --record LOG   Save the random seed and all input to LOG");
+    puts("  --replay LOG   Run again with the seed and input saved in LOG");
+    puts("  --checkpoint FILE");
+    puts("                 Append a checkpoint to FILE every --interval");
+    puts("  --interval N   Instructions between checkpoints (default 2^26) or");
+    puts("                 debugger snapshots (default 2^16)");
+    puts("  --restore      Continue from the last checkpoint in FILE");
+    puts("  --debug        Debug the program, reading commands from stdin");
+    puts("  --input FILE   Input of the program for --debug");
+    puts("  --watch A[:N]  Report writes changing cells A to A + N - 1");
+    puts("  --costs FILE   Read opcode weights, lines like `DIV 4`");
+    puts("  --time-limit N Fail after N units of time (default 50000000),");
+    puts("                 0 for no limit");
+    puts("  --timeout SEC  Fail after SEC seconds of wall-clock time");
+    puts("  --perf         Run basic blocks through code regions named in");
+    puts("                 /tmp/perf-<pid>.map and /tmp/jit-<pid>.dump");
+    exit(-1);
+}
+
+/**
+ * Command line options
+ */
+struct Options {
+    Options()
+            : mode(nullptr),
+              jobs(thread::hardware_concurrency()),
+              threads(thread::hardware_concurrency()),
+              quantum(Environment::DefaultQuantum),
+              profile(nullptr),
+              sample(0),
+              perf(false),
+              warmup(1),
+              repeat(5),
+              seed(1),
+              mix(nullptr),
+              history(nullptr),
+              commit(nullptr),
+              record(nullptr),
+              replay(nullptr),
+              checkpoint(nullptr),
+              interval(0),
+              restore(false),
+              debug(false),
+              input(nullptr),
+              costs(nullptr),
+              time_limit(Program::Timelimit),
+              timeout(0) {}
+
+    /**
+     * Mode flag such as `--batch`, NULL for running one program
+     */
+    const char *mode;
+
+    /**
+     * Positional arguments
+     */
+    vector<const char *> files;
+
+    size_t jobs;
+    size_t threads;
+    size_t quantum;
+
+    /**
+     * Format of the profile report, NULL to disable profiling
+     */
+    const char *profile;
+
+    /**
+     * Sampling frequency, 0 to count every instruction instead
+     */
+    size_t sample;
+
+    /**
+     * Whether to run through `PerfMap`
+     */
+    bool perf;
 
-        ASSERT(size <= MaxLexemeLength, "Lexeme too loog");
+    size_t warmup;
+    size_t repeat;
 
-        if (lexeme)
-            delete lexeme;
+    /**
+     * Seed and category weights of `--generate`
+     */
+    unsigned seed;
+    const char *mix;
 
-        lexeme = new char[size + 1];
-        memcpy(lexeme, buffer + beg, sizeof(char) * size);
-        lexeme[size] = '\0';
-    }
+    /**
+     * History file of `--bench` and `--compare`, and the commit to record
+     */
+    const char *history;
+    const char *commit;
 
-    bool equal_to(const char *str) const {
-        return equal(str, str + strlen(str), lexeme, lexeme + size);
-    }
+    /**
+     * Log written by `--record` and read by `--replay`
+     */
+    const char *record;
+    const char *replay;
 
-    bool is_int() const {
-        return size > 0 && isdigit(lexeme[size - 1]);
-    }
+    /**
+     * Checkpoint file, whether to continue from the file, and the interval
+     * of checkpoints or debugger snapshots, 0 for the default
+     */
+    const char *checkpoint;
+    size_t interval;
+    bool restore;
 
-    int as_int() const {
-        return atoi(lexeme);
-    }
+    /**
+     * Whether to run the debugger, and the input of the program
+     */
+    bool debug;
+    const char *input;
 
-    long as_long() const {
-        return atol(lexeme);
-    }
+    /**
+     * Watched ranges as first cell and length
+     */
+    vector<pair<size_t, size_t>> watch;
 
-    bool is_comment() const {
-        return size > 0 && lexeme[0] == '#';
-    }
+    /**
+     * Table of opcode weights, time limit and wall-clock timeout, 0 for none
+     */
+    const char *costs;
+    size_t time_limit;
+    double timeout;
+};  // struct Options
+
+Options parse_options(int argc, char *argv[]) {
+    Options options;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg[0] != '-')
+            options.files.push_back(arg);
+        else if (strcmp(arg, "-j") == 0 && has_value)
+            options.jobs = atol(argv[++i]);
+        else if (strcmp(arg, "--threads") == 0 && has_value)
+            options.threads = atol(argv[++i]);
+        else if (strcmp(arg, "--quantum") == 0 && has_value)
+            options.quantum = atol(argv[++i]);
+        else if (strcmp(arg, "--profile") == 0 && has_value &&
+                 (strcmp(argv[i + 1], "text") == 0 ||
+                  strcmp(argv[i + 1], "json") == 0 ||
+                  strcmp(argv[i + 1], "lines") == 0 ||
+                  strcmp(argv[i + 1], "folded") == 0))
+            options.profile = argv[++i];
+        else if (strcmp(arg, "--sample") == 0 && has_value)
+            options.sample = atol(argv[++i]);
+        else if (strcmp(arg, "--perf") == 0)
+            options.perf = true;
+        else if (strcmp(arg, "--warmup") == 0 && has_value)
+            options.warmup = atol(argv[++i]);
+        else if (strcmp(arg, "--repeat") == 0 && has_value)
+            options.repeat = atol(argv[++i]);
+        else if (strcmp(arg, "--seed") == 0 && has_value)
+            options.seed = atol(argv[++i]);
+        else if (strcmp(arg, "--mix") == 0 && has_value)
+            options.mix = argv[++i];
+        else if (strcmp(arg, "--history") == 0 && has_value)
+            options.history = argv[++i];
+        else if (strcmp(arg, "--commit") == 0 && has_value)
+            options.commit = argv[++i];
+        else if (strcmp(arg, "--record") == 0 && has_value)
+            options.record = argv[++i];
+        else if (strcmp(arg, "--replay") == 0 && has_value)
+            options.replay = argv[++i];
+        else if (strcmp(arg, "--checkpoint") == 0 && has_value)
+            options.checkpoint = argv[++i];
+        else if (strcmp(arg, "--interval") == 0 && has_value)
+            options.interval = atol(argv[++i]);
+        else if (strcmp(arg, "--restore") == 0)
+            options.restore = true;
+        else if (strcmp(arg, "--debug") == 0)
+            options.debug = true;
+        else if (strcmp(arg, "--input") == 0 && has_value)
+            options.input = argv[++i];
+        else if (strcmp(arg, "--costs") == 0 && has_value)
+            options.costs = argv[++i];
+        else if (strcmp(arg, "--time-limit") == 0 && has_value)
+            options.time_limit = atol(argv[++i]);
+        else if (strcmp(arg, "--timeout") == 0 && has_value)
+            options.timeout = atof(argv[++i]);
+        else if (strcmp(arg, "--watch") == 0 && has_value) {
+            const char *range = argv[++i];
+            const char *colon = strchr(range, ':');
+            options.watch.emplace_back(atol(range),
+                                       colon ? atol(colon + 1) : 1);
+        } else if (!options.mode && (strcmp(arg, "--batch") == 0 ||
+                                     strcmp(arg, "--server") == 0 ||
+                                     strcmp(arg, "--submit") == 0 ||
+                                     strcmp(arg, "--stream") == 0 ||
+                                     strcmp(arg, "--pipeline") == 0 ||
+                                     strcmp(arg, "--fork-server") == 0 ||
+                                     strcmp(arg, "--bench") == 0 ||
+                                     strcmp(arg, "--compare") == 0 ||
+                                     strcmp(arg, "--microbench") == 0 ||
+                                     strcmp(arg, "--bench-loader") == 0 ||
+                                     strcmp(arg, "--generate") == 0))
+            options.mode = arg;
+        else
+            usage();
+    }  // for
 
-    long long as_long_long() const {
-        return atoll(lexeme);
-    }
+    return options;
+}
 
-    size_t size;
-    char *lexeme;
-};  // struct Token
+string read_file(FILE *in) {
+    string text;
+    char buffer[4096];
 
-///////////////
-// TOKENIZER //
-///////////////
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        text.append(buffer, n);
 
-class Tokenizer {
- public:
-    list<Token> tokenize(const char *buffer) const {
-        enum TokenType { UNKNOWN, ALPHAS, SIGNS, COMMENTS, DIGITS };
+    return text;
+}
 
-        TokenType mode = UNKNOWN;
-        size_t lastpos = 0;
-        list<Token> tokens;
-        for (size_t pos = 0; buffer[pos]; pos++) {
-            char c = buffer[pos];
+void load_file(const char *path, Program &program) {
+    FileGuard in(fopen(path, "r"), fclose);
+    if (!in)
+        ASSERT(false, "No ASM file found.");
 
-            TokenType type;
-            if (isalpha(c))
-                type = ALPHAS;
-            else if (isdigit(c) || c == '-')
-                type = DIGITS;
-            else if (c == '*')
-                type = SIGNS;
-            else if (c == '#')
-                type = COMMENTS;
-            else if (isspace(c))
-                type = UNKNOWN;
-            else
-                ASSERT(false, "Unrecognized character")
+    Parser parser;
+    parser.load(in.get(), program);
+}
 
-            if (type == UNKNOWN) {
-                if (mode != UNKNOWN) {
-                    mode = UNKNOWN;
-                    tokens.push_back(Token(buffer, lastpos, pos));
-                }
-            } else {
-                if (mode == UNKNOWN) {
-                    mode = type;
-                    lastpos = pos;
-                } else if (mode != type) {
-                    mode = UNKNOWN;
-                    tokens.push_back(Token(buffer, lastpos, pos));
-                    pos--;
-                }
-            }
+/**
+ * Program whose writes are reported by `report_watch`
+ */
+const Program *watched_program = nullptr;
 
-            if (type == COMMENTS)
-                break;
-        }  // for
+/**
+ * Print a change of a watched cell to stderr
+ * @remark Called from a signal handler
+ */
+void report_watch(size_t pos, int old_value, int new_value) {
+    int position = Sampler::position();
+    char buffer[128];
+    int n = snprintf(buffer,
+                     sizeof(buffer),
+                     "(WATCH) [%zu] %d -> %d at command %d (line %d)\n",
+                     pos,
+                     old_value,
+                     new_value,
+                     position,
+                     position >= 0 ? watched_program->line(position) : 0);
+    ssize_t written = write(STDERR_FILENO, buffer, n);
+    (void) written;
+}
 
-        return tokens;
-    }
-};  // class Tokenizer
+/**
+ * Print a profile in the format of `--profile`
+ * @param profile Profile
+ * @param format  Format name
+ * @param path    Path of the program
+ */
+void report(const Profile &profile, const char *format, const char *path) {
+    if (strcmp(format, "json") == 0)
+        profile.print_json(stderr);
+    else if (strcmp(format, "lines") == 0)
+        profile.print_lines(stderr);
+    else if (strcmp(format, "folded") == 0)
+        profile.print_folded(stderr, path);
+    else
+        profile.print(stderr);
+}
 
-////////////
-// PARSER //
-////////////
+/**
+ * Read a table of opcode weights
+ * @param  path Path of the table
+ * @return      Default weights overridden by the table
+ */
+CostModel load_costs(const char *path) {
+    FileGuard table(fopen(path, "r"), fclose);
+    CHECK(table != nullptr, InvalidArgument, "No cost table found");
 
-class Parser {
- public:
-    constexpr static size_t MaxIntegerLength = 10;
+    CostModel model;
+    model.load(table.get());
 
-    typedef Program::Command Command;
-    typedef list<Token> TokenList;
+    return model;
+}
 
-    template <typename TIterator>
-    void read_value(TIterator &beg, const TIterator end, Value &target) const {
-        int value;
-        size_t recur = 0;
-        while (true) {
-            ASSERT(beg != end, "Invalid value");
+/**
+ * Return the limits given by `--time-limit` and `--timeout`
+ * @param  options Parsed options
+ * @return         Limits
+ */
+Limits limits_of(const Options &options) {
+    Limits limits;
+    limits.time_limit = options.time_limit ? options.time_limit : SIZE_MAX;
+    limits.timeout = options.timeout;
 
-            if (beg->is_int()) {
-                ASSERT(beg->size <= MaxIntegerLength, "Integer too long");
+    return limits;
+}
 
-                value = beg->as_int();
-                beg++;
-                break;
-            } else
-                recur += beg->size;
+/**
+ * Load a program and apply `--costs`
+ * @param options Parsed options
+ * @param path    Path of the program
+ * @param program Target
+ */
+void load_program(const Options &options, const char *path, Program &program) {
+    load_file(path, program);
+    if (options.costs)
+        program.set_costs(load_costs(options.costs));
+}
 
-            beg++;
-        }  // while
+/**
+ * Run the mode selected by command line options
+ * @param  options Parsed options
+ * @return         Exit code of the process
+ */
+int run_mode(const Options &options) {
+    auto &files = options.files;
+    const char *format = options.profile ? options.profile : "text";
+    Limits limits = limits_of(options);
+
+    if (options.mode && strcmp(options.mode, "--batch") == 0) {
+        if (files.size() != 3)
+            usage();
+
+        Program image;
+        load_program(options, files[0], image);
+
+        BatchRunner runner(image, options.jobs, limits);
+        if (options.sample) {
+            Sampler sampler(image, options.sample);
+            sampler.start();
+            runner.run(files[1], files[2]);
+            sampler.stop();
+            report(sampler.profile(), format, files[0]);
+        } else {
+            Profile profile(image);
+            runner.run(files[1],
+                       files[2],
+                       options.profile ? &profile : nullptr);
+            if (options.profile)
+                report(profile, format, files[0]);
+        }
 
-        target.set(value, recur);
+        return runner.failures() > 0 ? 1 : 0;
     }
 
-    Command parse_nop(const TokenList &tokens) const {
-        if (tokens.back().is_int()) {
-            auto instruction = new TaggedNopInstruction;
-            auto args = new TaggedNopInstruction::TaggedNopArgs;
-            auto beg = std::next(tokens.begin());
+    if (options.mode && strcmp(options.mode, "--server") == 0) {
+        if (files.size() != 1)
+            usage();
 
-            read_value(beg, tokens.end(), args->index);
+        Server server(options.jobs,
+                      limits,
+                      options.costs ? load_costs(options.costs) : CostModel());
+        server.listen(files[0]);
 
-            return { instruction, args };
-        } else {
-            auto instruction = new NopInstruction;
-            auto args = new NopInstruction::NopArgs;
+        return 0;
+    }
 
-            return { instruction, args };
-        }
+    if (options.mode && strcmp(options.mode, "--submit") == 0) {
+        if (files.size() != 2)
+            usage();
+
+        FILE *in = fopen(files[1], "r");
+        if (!in)
+            ASSERT(false, "No ASM file found.");
+        string source = read_file(in);
+        fclose(in);
+
+        return submit(files[0], source, read_file(stdin));
     }
 
-    template <typename TInstruction>
-    Command parse_i(const TokenList &tokens) const {
-        auto instruction = new TInstruction;
-        auto args = new typename TInstruction::ArgsType;
-        auto beg = std::next(tokens.begin());
+    if (options.mode && strcmp(options.mode, "--stream") == 0) {
+        if (files.size() != 1)
+            usage();
+
+        Program program;
+        load_program(options, files[0], program);
 
-        read_value(beg, tokens.end(), args->index);
+        Reactor reactor(limits);
+        reactor.add(program, STDIN_FILENO, STDOUT_FILENO);
+        reactor.run();
 
-        return { instruction, args };
+        return 0;
     }
 
-    template <typename TInstruction>
-    Command parse_v(const TokenList &tokens) const {
-        auto instruction = new TInstruction;
-        auto args = new typename TInstruction::ArgsType;
-        auto beg = std::next(tokens.begin());
+    if (options.mode && strcmp(options.mode, "--pipeline") == 0) {
+        if (files.empty())
+            usage();
 
-        read_value(beg, tokens.end(), args->value);
+        vector<unique_ptr<Program>> programs;
+        Pipeline pipeline(limits);
+        for (auto path : files) {
+            programs.emplace_back(new Program);
+            load_program(options, path, *programs.back());
+            pipeline.append(*programs.back());
+        }  // foreach in files
 
-        return { instruction, args };
+        return pipeline.run(stdin, stdout) ? 0 : -1;
     }
 
-    template <typename TInstruction>
-    Command parse_vv(const TokenList &tokens) const {
-        auto instruction = new TInstruction;
-        auto args = new typename TInstruction::ArgsType;
-        auto beg = std::next(tokens.begin());
+    if (options.mode && strcmp(options.mode, "--fork-server") == 0) {
+        if (files.size() != 1)
+            usage();
+
+        Program program;
+        load_program(options, files[0], program);
 
-        read_value(beg, tokens.end(), args->value1);
-        read_value(beg, tokens.end(), args->value2);
+        ForkServer server(program, options.jobs, limits);
+        server.serve(stdin, stdout);
 
-        return { instruction, args };
+        return 0;
     }
 
-    template <typename TInstruction>
-    Command parse_vi(const TokenList &tokens) const {
-        auto instruction = new TInstruction;
-        auto args = new typename TInstruction::ArgsType;
-        auto beg = std::next(tokens.begin());
+    if (options.mode && strcmp(options.mode, "--bench") == 0) {
+        if (files.empty())
+            usage();
 
-        read_value(beg, tokens.end(), args->value);
-        read_value(beg, tokens.end(), args->index);
+        unique_ptr<History> history;
+        if (options.history)
+            history.reset(new History(options.history, options.commit));
 
-        return { instruction, args };
+        Benchmark benchmark(options.warmup, options.repeat, history.get());
+        bool ok = true;
+        for (auto path : files)
+            ok &= benchmark.run(path, stdout);
+
+        return ok ? 0 : 1;
     }
 
-    template <typename TInstruction>
-    Command parse_vvi(const TokenList &tokens) const {
-        auto instruction = new TInstruction;
-        auto args = new typename TInstruction::ArgsType;
-        auto beg = std::next(tokens.begin());
+    if (options.mode && strcmp(options.mode, "--compare") == 0) {
+        if (files.size() != 2 || !options.history)
+            usage();
+
+        History history(options.history, files[0]);
+        return history.compare(files[0], files[1], stdout) ? 0 : 1;
+    }
 
-        read_value(beg, tokens.end(), args->value1);
-        read_value(beg, tokens.end(), args->value2);
-        read_value(beg, tokens.end(), args->index);
+    if (options.mode && strcmp(options.mode, "--microbench") == 0) {
+        MicroBenchmark benchmark(options.repeat);
+        benchmark.run(files, stdout);
 
-        return { instruction, args };
+        return 0;
     }
 
-    Command parse(const char *line) const {
-        TokenList tokens = _tokenizer.tokenize(line);
+    if (options.mode && strcmp(options.mode, "--bench-loader") == 0) {
+        if (files.empty())
+            usage();
 
-        if (tokens.empty() || tokens.front().is_comment())
-            return { new NopInstruction, new NopInstruction::NopArgs };
+        LoaderBenchmark benchmark(options.repeat);
+        for (auto path : files)
+            benchmark.run(path, stdout);
 
-        if (tokens.front().equal_to("NOP"))  // NOP and Tagger NOP
-            return parse_nop(tokens);
-        else if (tokens.front().equal_to("MEM"))
-            return parse_v<MemInstruction>(tokens);
-        else if (tokens.front().equal_to("IN"))
-            return parse_i<InInstruction>(tokens);
-        else if (tokens.front().equal_to("OUT"))
-            return parse_v<OutInstruction>(tokens);
-        else if (tokens.front().equal_to("SET"))
-            return parse_vi<SetInstruction>(tokens);
-        else if (tokens.front().equal_to("ADD"))
-            return parse_vvi<AddInstruction>(tokens);
-        else if (tokens.front().equal_to("SUB"))
-            return parse_vvi<SubInstruction>(tokens);
-        else if (tokens.front().equal_to("MUL"))
-            return parse_vvi<MulInstruction>(tokens);
-        else if (tokens.front().equal_to("DIV"))
-            return parse_vvi<DivInstruction>(tokens);
-        else if (tokens.front().equal_to("MOD"))
-            return parse_vvi<ModInstruction>(tokens);
-        else if (tokens.front().equal_to("INC"))
-            return parse_vi<IncInstruction>(tokens);
-        else if (tokens.front().equal_to("DEC"))
-            return parse_vi<DecInstruction>(tokens);
-        else if (tokens.front().equal_to("NEC"))
-            return parse_vi<NecInstruction>(tokens);
-        else if (tokens.front().equal_to("AND"))
-            return parse_vvi<AndInstruction>(tokens);
-        else if (tokens.front().equal_to("OR"))
-            return parse_vvi<OrInstruction>(tokens);
-        else if (tokens.front().equal_to("XOR"))
-            return parse_vvi<XorInstruction>(tokens);
-        else if (tokens.front().equal_to("FLIP"))
-            return parse_vi<FlipInstruction>(tokens);
-        else if (tokens.front().equal_to("NOT"))
-            return parse_vi<NotInstruction>(tokens);
-        else if (tokens.front().equal_to("SHL"))
-            return parse_vvi<ShlInstruction>(tokens);
-        else if (tokens.front().equal_to("SHR"))
-            return parse_vvi<ShrInstruction>(tokens);
-        else if (tokens.front().equal_to("ROL"))
-            return parse_vvi<RolInstruction>(tokens);
-        else if (tokens.front().equal_to("ROR"))
-            return parse_vvi<RorInstruction>(tokens);
-        else if (tokens.front().equal_to("EQU"))
-            return parse_vvi<EquInstruction>(tokens);
-        else if (tokens.front().equal_to("GTER"))
-            return parse_vvi<GterInstruction>(tokens);
-        else if (tokens.front().equal_to("LESS"))
-            return parse_vvi<LessInstruction>(tokens);
-        else if (tokens.front().equal_to("GEQ"))
-            return parse_vvi<GeqInstruction>(tokens);
-        else if (tokens.front().equal_to("LEQ"))
-            return parse_vvi<LeqInstruction>(tokens);
-        else if (tokens.front().equal_to("JMP"))
-            return parse_v<JmpInstruction>(tokens);
-        else if (tokens.front().equal_to("JMOV"))
-            return parse_v<JmovInstruction>(tokens);
-        else if (tokens.front().equal_to("JIF"))
-            return parse_vv<JifInstruction>(tokens);
-        else if (tokens.front().equal_to("JIFM"))
-            return parse_vv<JifmInstruction>(tokens);
-        else
-            ASSERT(false, "Unknown instruction");
+        return 0;
     }
 
- private:
-    Tokenizer _tokenizer;
-};  // class Parser
+    if (options.mode && strcmp(options.mode, "--generate") == 0) {
+        if (files.size() != 1)
+            usage();
 
-///////////////////
-// MAIN FUNCTION //
-///////////////////
+        Generator generator(options.seed);
+        if (options.mix)
+            generator.set_mix(options.mix);
+        generator.generate(atol(files[0]), stdout);
 
-int main() {
-    FILE *in = nullptr;
+        return 0;
+    }
 
-    in = fopen("test.asm", "r");
-    if (!in)
-        ASSERT(false, "No ASM file found.");
+    if (files.size() > 1 || (options.record && options.replay) ||
+        (options.restore && !options.checkpoint) ||
+        (options.checkpoint &&
+         (options.record || options.replay || options.perf)) ||
+        (options.debug && (options.checkpoint || options.record ||
+                           options.perf || options.profile || options.sample ||
+                           !options.watch.empty())))
+        usage();
 
-    Parser parser;
+    const char *path = files.empty() ? "test.asm" : files[0];
     Program program;
-    program.make_environment();
+    load_program(options, path, program);
+
+    Environment env(program);
+    env.workers = options.threads;
+    env.quantum = options.quantum;
+    env.time_limit = limits.time_limit;
+
+    // Seeding after loading keeps `randint` calls of the parser out of the log
+    unique_ptr<InputStream> log;
+    if (options.record) {
+        uint32_t seed = random_device{}();
+        log.reset(new RecordInput(env.input,
+                                  options.record,
+                                  ExecutionLog::fingerprint(path),
+                                  seed));
+        random_generator().seed(seed);
+        env.input = log.get();
+    } else if (options.replay) {
+        auto replay = new ReplayInput(options.replay,
+                                      ExecutionLog::fingerprint(path));
+        log.reset(replay);
+        random_generator().seed(replay->seed());
+        env.input = log.get();
+    }
 
-    char buffer[2048];
-    while (fgets(buffer, sizeof(buffer), in)) {
-        auto command = parser.parse(buffer);
+    Profile profile(program);
+    unique_ptr<Sampler> sampler;
+    if (options.sample) {
+        sampler.reset(new Sampler(program, options.sample));
+        sampler->start();
+    } else if (options.profile)
+        env.profile = &profile;
+
+    unique_ptr<PerfMap> perf;
+    if (options.perf)
+        perf.reset(new PerfMap(program, path));
+
+    unique_ptr<Checkpointer> checkpointer;
+    size_t interval = options.interval;
+    if (options.checkpoint)
+        checkpointer.reset(new Checkpointer(
+                options.checkpoint,
+                interval ? interval : Checkpointer::DefaultInterval,
+                ExecutionLog::fingerprint(path),
+                options.restore));
+
+    program.run_partical(env);
+    if (options.debug) {
+        CHECK(!program.threaded(),
+              Unsupported,
+              "SPAWN is not supported by --debug");
+
+        FILE *input = fopen(options.input ? options.input : "/dev/null", "r");
+        CHECK(input != nullptr, InvalidArgument, "No input file found");
+        if (!options.replay)
+            env.open(input, stdout);
+
+        Debugger debugger(
+                env, path, interval ? interval : Debugger::DefaultInterval);
+        debugger.repl(stdin);
+        fclose(input);
 
-        if (command.is_valid())
-            program.append(command);
-    }  // while
+        return 0;
+    }
 
-    program.run_partical();
-    program.run();
+    if (options.restore)
+        checkpointer->restore(env, stdin, stdout);
+
+    watched_program = &program;
+    for (auto &w : options.watch)
+        env.memory.watch(w.first, w.second, report_watch);
+
+    auto watchdog = limits.apply(env);
+
+    Program::Status status;
+    if (checkpointer)
+        status = checkpointer->run(env, stdin, stdout);
+    else
+        status = perf ? perf->run(env) : program.run(env);
+    if (sampler) {
+        sampler->stop();
+        report(sampler->profile(), format, path);
+    } else if (options.profile)
+        report(profile, format, path);
+    if (status == Program::Failed) {
+        env.error.print(stdout);
+        return -1;
+    }
 
     return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Options options = parse_options(argc, argv);
+
+    try {
+        return run_mode(options);
+    } catch (const Error &e) {
+        e.print(stdout);
+        return -1;
+    }
 }  // function main